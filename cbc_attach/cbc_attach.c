@@ -17,6 +17,7 @@
 #include <string.h>
 #include <errno.h>
 #include <termios.h>
+#include <libgen.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <fcntl.h>
@@ -31,10 +32,33 @@
 #endif
 
 #include <linux/tty.h>
+#include <linux/serial.h>
 #ifndef N_CBCCORE
 #define N_CBCCORE 27
 #endif
 
+/* <asm/termbits.h> clashes with <termios.h>, so the termios2 layout of
+ * asm-generic is repeated here for TCGETS2/TCSETS2.
+ */
+#if defined(TCGETS2) && defined(TCSETS2)
+#define HAVE_TERMIOS2
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#define KERNEL_NCCS 19
+
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[KERNEL_NCCS];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+#endif
+
 #define VERSION_MAJOR 4
 #define VERSION_MINOR 2
 #define VERSION_REVISON 2
@@ -52,8 +76,29 @@ static struct option longOpts[] = {
 	{"baudrate", required_argument, 0, 'b'},
 	{"hardwareFlowControl", no_argument, 0, 'f'},
 	{"min-receive-bytes", required_argument, 0, 'm'},
+	{"profile", required_argument, 0, 'p'},
 	{0, 0, 0, 0}
 };
+
+/*
+ * Serial line profiles, trading throughput for latency. lowLatency and
+ * rxTrigBytes are left to the driver when -1; the UART picks the
+ * closest RX FIFO trigger level not above rxTrigBytes.
+ */
+struct lineProfile {
+	char const *name;
+	uint8_t minReceiveBytes;	/* VMIN */
+	uint8_t receiveTimeout;		/* VTIME, 100ms units */
+	int lowLatency;			/* ASYNC_LOW_LATENCY */
+	int rxTrigBytes;		/* sysfs rx_trig_bytes */
+};
+
+static const struct lineProfile lineProfiles[] = {
+	{"low-latency", 1, 0, 1, 1},
+	{"balanced", 255, 1, -1, -1},
+	{"bulk", 255, 1, 0, 255},
+};
+#define DEFAULT_PROFILE (&lineProfiles[1])
 /* granularity is currently a module parameter -> not set from this tool. */
 
 void printMainUsage(void)
@@ -62,11 +107,17 @@ void printMainUsage(void)
 	printf("to serial line\n\n");
 	printf("Usage: cbc_attach [OPTION]... [TTY-DEVICE]...\n\n");
 	printf("-h , --help                 Help\n");
-	printf("-b , --baudrate=<Baudrate>  Baudrate e.g.:4000000\n");
+	printf("-b , --baudrate=<Baudrate>  Baudrate e.g.:4000000, any ");
+	printf("rate the UART supports\n");
 	printf("-f , --hardwareFlowControl  Use hardware flow control\n");
 	printf("-m , --min-receive-bytes    Minimum number of bytes to ");
 	printf("receive from the serial device ");
-	printf("(range:0-255, default:255)\n");
+	printf("(range:0-255, default from the profile)\n");
+	printf("-p , --profile=<Profile>    Serial line profile: ");
+	printf("low-latency, balanced or bulk\n");
+	printf("                            default: from %s, ",
+					cDEFAULT_MATCH_CONF);
+	printf("else %s\n", DEFAULT_PROFILE->name);
 	printf("<tty-device>                Name of the serial line. ");
 	printf("default: %s\n", cDEFAULT_DEVICE_NAME);
 }
@@ -172,19 +223,64 @@ bool convertBaudRate(const uint32_t baudRateInt, speed_t *baudRate)
 }
 
 
+/*
+ * Set any integer baud rate with BOTHER and store the rate the driver
+ * reports back in actualBaudRate. Returns false when termios2 is not
+ * supported by the kernel or the driver, errno is kept for the caller.
+ */
+bool setBaudRate2(int deviceFd, const uint32_t baudRateInt,
+				uint32_t *actualBaudRate)
+{
+#ifdef HAVE_TERMIOS2
+	struct termios2 tio;
+
+	if (ioctl(deviceFd, TCGETS2, &tio) != 0)
+		return false;
+
+	tio.c_cflag &= ~(CBAUD | CIBAUD);
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = baudRateInt;
+	tio.c_ospeed = baudRateInt;
+	if (ioctl(deviceFd, TCSETS2, &tio) != 0)
+		return false;
+
+	if (ioctl(deviceFd, TCGETS2, &tio) != 0)
+		return false;
+	*actualBaudRate = tio.c_ospeed;
+	return true;
+#else
+	(void)deviceFd;
+	(void)baudRateInt;
+	(void)actualBaudRate;
+	errno = ENOTTY;
+	return false;
+#endif
+}
+
+
+const struct lineProfile *findProfile(char const *const name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(lineProfiles) / sizeof(lineProfiles[0]); i++)
+		if (strcmp(lineProfiles[i].name, name) == 0)
+			return &lineProfiles[i];
+	return NULL;
+}
+
+
 bool initTerminal(int deviceFd, const uint32_t baudRateInt,
 				const bool useHardwareFlowControl,
-				const uint8_t minReceiveBytes)
+				const uint8_t minReceiveBytes,
+				const uint8_t receiveTimeout)
 {
 	bool success = true;
 	struct termios terminalSettings;
 
 	speed_t baudRate = B0;
-
-	if (!convertBaudRate(baudRateInt, &baudRate)) {
-		printf("Invalid baud rate given %i\n", baudRateInt);
-		success = false;
-	}
+	/* without a Bxxxx constant the rate can only be set with termios2 */
+	bool haveBaudRate = convertBaudRate(baudRateInt, &baudRate);
+	uint32_t actualBaudRate = 0;
 
 	if (success) {
 		int res = tcgetattr(deviceFd, &terminalSettings);
@@ -218,14 +314,15 @@ bool initTerminal(int deviceFd, const uint32_t baudRateInt,
 		/* Set raw mode. */
 		cfmakeraw(&terminalSettings);
 
-		/* Set VTIME to 1 to get a read() timeout of 100ms. */
-		terminalSettings.c_cc[VTIME] = 1u;
+		/* Set VTIME, e.g. 1 to get a read() timeout of 100ms. */
+		terminalSettings.c_cc[VTIME] = receiveTimeout;
 
 		/* Set VMIN. */
 		terminalSettings.c_cc[VMIN] = minReceiveBytes;
 
-		/* Set baudrate. */
-		int res = cfsetspeed(&terminalSettings, baudRate);
+		/* Set baudrate, the current one is kept for termios2. */
+		int res = haveBaudRate ?
+			cfsetspeed(&terminalSettings, baudRate) : 0;
 
 		if (res != 0) {
 			printf("Failed to set serial speed (error: %s)\n",
@@ -234,7 +331,7 @@ bool initTerminal(int deviceFd, const uint32_t baudRateInt,
 		}
 	}
 
-	if (success) {
+	if (success && haveBaudRate) {
 		int res = cfsetospeed(&terminalSettings, baudRate);
 
 		if (res != 0) {
@@ -255,10 +352,81 @@ bool initTerminal(int deviceFd, const uint32_t baudRateInt,
 		}
 	}
 
+	if (success) {
+		if (setBaudRate2(deviceFd, baudRateInt, &actualBaudRate)) {
+			printf("Baud rate %u (requested %u)\n",
+					actualBaudRate, baudRateInt);
+		} else if (haveBaudRate) {
+			/* the table rate set by tcsetattr stays */
+			printf("termios2 not available (error: %s), ",
+					strerror(errno));
+			printf("baud rate %u from table\n", baudRateInt);
+		} else {
+			printf("Invalid baud rate given %u ", baudRateInt);
+			printf("(termios2 error: %s)\n", strerror(errno));
+			success = false;
+		}
+	}
+
 	return success;
 }
 
 
+/* Not every UART driver supports it, failures are only reported. */
+void setLowLatency(int deviceFd, const int lowLatency)
+{
+	struct serial_struct serial;
+
+	if (lowLatency < 0)
+		return;
+
+	if (ioctl(deviceFd, TIOCGSERIAL, &serial) != 0) {
+		printf("Failed to get serial info (error: %s)\n",
+					strerror(errno));
+		return;
+	}
+
+	if (lowLatency)
+		serial.flags |= ASYNC_LOW_LATENCY;
+	else
+		serial.flags &= ~ASYNC_LOW_LATENCY;
+
+	if (ioctl(deviceFd, TIOCSSERIAL, &serial) != 0)
+		printf("Failed to set low latency (error: %s)\n",
+					strerror(errno));
+}
+
+
+/* Only 8250 UARTs with a configurable FIFO have rx_trig_bytes. */
+void setRxTrigger(char const *const deviceName, const int rxTrigBytes)
+{
+	char path[256];
+	char name[256];
+	char value[16];
+	FILE *file;
+
+	if (rxTrigBytes < 0)
+		return;
+
+	snprintf(name, sizeof(name), "%s", deviceName);
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/rx_trig_bytes",
+					basename(name));
+	file = fopen(path, "r+");
+	if (!file)
+		return;
+
+	if (fprintf(file, "%d\n", rxTrigBytes) < 0 || fflush(file) != 0) {
+		printf("Failed to set %s (error: %s)\n", path,
+					strerror(errno));
+	} else {
+		rewind(file);
+		if (fgets(value, sizeof(value), file))
+			printf("RX FIFO trigger level %s", value);
+	}
+	fclose(file);
+}
+
+
 void cbc_attach_shutdown(int *const deviceFd)
 {
 	if (*deviceFd > 0) {
@@ -297,7 +465,8 @@ bool init(int *const deviceFd,
 	  char const *const deviceName,
 	  uint32_t const baudRateInt,
 	  bool const useHardwareFlowControl,
-	  uint8_t const minReceiveBytes)
+	  uint8_t const minReceiveBytes,
+	  const struct lineProfile *const profile)
 {
 	/* TODO check whether VMIN/VTIME handling is necessary */
 	bool success = true;
@@ -307,7 +476,13 @@ bool init(int *const deviceFd,
 	if (success) {
 		success = initTerminal(*deviceFd, baudRateInt,
 					useHardwareFlowControl,
-					minReceiveBytes);
+					minReceiveBytes,
+					profile->receiveTimeout);
+	}
+
+	if (success) {
+		setLowLatency(*deviceFd, profile->lowLatency);
+		setRxTrigger(deviceName, profile->rxTrigBytes);
 	}
 
 	if (success) {
@@ -331,24 +506,34 @@ bool init(int *const deviceFd,
 	return success;
 }
 
-static const char *match_deviceName(const char *dfl)
+/*
+ * cbc_match.txt lines: <sysfs device> | <tty> | [acrn] | [profile]
+ * The profile of the matching line is returned in profileName, if any.
+ */
+static const char *match_deviceName(const char *dfl, const char **profileName)
 {
 	FILE * file = fopen(cDEFAULT_MATCH_CONF, "rb");
 	char line[256];
 	char device[256];
 	static char tty[256];
+	static char profile[32];
+	int n;
 
 	if (!file)
 		goto no_match_file;
 	while (1) {
 		if (!fgets(line, 255, file))
 			goto no_match;
-		if (sscanf(line, "%s | %s", device, tty) != 2)
+		n = sscanf(line, "%255s | %255s | %*s | %31s", device, tty,
+					profile);
+		if (n < 2)
 			goto no_match;
 		if (!access(device, F_OK))
 			break;
 	}
 	fclose(file);
+	if (n == 3)
+		*profileName = profile;
 	return tty;
 no_match:
 	fclose(file);
@@ -365,7 +550,10 @@ int main(int argc, char **argv)
 	char const *deviceName = cDEFAULT_DEVICE_NAME;
 	int baudrate = 4000000;
 	bool useHwFlowControl = false;
-	uint8_t minReceiveBytes = 255;
+	int minReceiveBytes = -1;
+	char const *profileName = NULL;
+	char const *matchProfileName = NULL;
+	const struct lineProfile *profile;
 	int deviceFd = 0;
 
 	/* Retry times and uint */
@@ -395,7 +583,7 @@ int main(int argc, char **argv)
 		deviceName = envDeviceName;
 
 	while (1) {
-		c = getopt_long(argc, argv, "hb:f", longOpts, &optionIndex);
+		c = getopt_long(argc, argv, "hb:fm:p:", longOpts, &optionIndex);
 		if (c == -1)
 			break;
 
@@ -420,6 +608,20 @@ int main(int argc, char **argv)
 			useHwFlowControl = true;
 			break;
 
+		case 'm':
+			minReceiveBytes = atoi(optarg);
+			if (minReceiveBytes < 0 || minReceiveBytes > 255) {
+				printf("Invalid min receive bytes %s,exiting\n",
+								optarg);
+				ret = -1;
+				goto exit;
+			}
+			break;
+
+		case 'p':
+			profileName = optarg;
+			break;
+
 		default:
 			ret = -1;
 			goto exit;
@@ -430,16 +632,29 @@ int main(int argc, char **argv)
 		deviceName = argv[optind];
 
 	/* give the platform a choice to auto match the tty device */
-	deviceName = match_deviceName(deviceName);
+	deviceName = match_deviceName(deviceName, &matchProfileName);
+
+	/* the command line wins over cbc_match.txt */
+	if (!profileName)
+		profileName = matchProfileName;
+	profile = profileName ? findProfile(profileName) : DEFAULT_PROFILE;
+	if (!profile) {
+		printf("Unknown profile %s,exiting\n", profileName);
+		ret = -1;
+		goto exit;
+	}
+	if (minReceiveBytes < 0)
+		minReceiveBytes = profile->minReceiveBytes;
 
 	printf("%s " APP_INFO " Started (pid: %i, CBC device: %s,", argv[0],
 					getpid(), deviceName);
-	printf("baudrate: %i, hw flow control: %s)\n", baudrate,
-					useHwFlowControl ? "on" : "off");
+	printf("baudrate: %i, hw flow control: %s, profile: %s)\n", baudrate,
+					useHwFlowControl ? "on" : "off",
+					profile->name);
 	do {
 		/* set up serial line */
 		success = init(&deviceFd, deviceName, baudrate,
-				useHwFlowControl, minReceiveBytes);
+				useHwFlowControl, minReceiveBytes, profile);
 		if (success)
 			break;
 
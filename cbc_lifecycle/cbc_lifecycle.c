@@ -40,31 +40,59 @@
  * | vm stop          |(Events from /dev/cbc-lifecycle port)
  * ~~~~~~~~~~~~~~~~~~~~
  *
- * 3 threads: 1. wake on /dev/cbc-lifecycle and receive wakeup reasons
- *            2. heartbeat thread to send heartbeat msg to /dev/cbc-lifecycle
- *            3. server socket handler thread to handle incoming msg
+ * 1 epoll loop: wakeup reasons from /dev/cbc-lifecycle, heartbeats paced
+ *               by a CLOCK_MONOTONIC timerfd, an eventfd posted by the
+ *               handlers on state changes for an immediate heartbeat, and
+ *               the suspend progress from the system-sleep hook FIFO (or
+ *               logind PrepareForSleep with WITH_SDBUS)
+ * libacrn-mngr runs the server socket handlers in its own thread
  */
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <stdatomic.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <linux/tty.h>
 #include <acrn/acrn_mngr.h>
+#ifdef WITH_SDBUS
+#include <systemd/sd-bus.h>
+#endif
+
+extern char **environ;
 
 static char cbcd_name[] = "sos-lcs";
 static char acrnd_name[] = "acrnd";
-static char cbc_lifecycle_dev[] = "/dev/cbc-lifecycle";
+#define LCS_PATH_MAX 256
+/* overridden with -d and -r, e.g. for cbc_lifecycle_sim */
+static const char *cbc_lifecycle_dev = "/dev/cbc-lifecycle";
 static char cbc_match_file[] = "/usr/share/ioc-cbc-tools/cbc_match.txt";
+#define LCS_CONF_FILE "/etc/ioc-cbc-tools/cbc_lifecycle.conf"
+#define LCS_CONF_DEFAULT_FILE "/usr/share/ioc-cbc-tools/cbc_lifecycle.conf"
+/* written by the cbc_lifecycle_suspend system-sleep hook: "pre" or "post" */
+static char cbc_sleep_fifo[LCS_PATH_MAX] = "/run/cbc_lifecycle.sleep";
+/* transition trace report, written on SIGUSR1 or LCS_TRACE_DUMP */
+static char cbc_trace_file[LCS_PATH_MAX] = "/run/cbc_lifecycle.trace";
+/* pending RTC wakeup timers of the VMs, one "time vmname" per line */
+static char cbc_rtc_file[LCS_PATH_MAX] = "/var/lib/cbc_lifecycle/rtc_timers";
 
 typedef enum {
 	S_DEFAULT = 0,	     /* default, not receiving any status */
@@ -78,17 +106,67 @@ typedef enum {
 	S_MAX,
 } state_machine_t;
 
-/* state machine valid transition table */
-char valid_map[S_MAX][S_MAX] = {
-	{ 1, 1, 1, 0, 0, 0, 0, 0 }, /* default can go alive or shutdown */
-	{ 0, 1, 1, 0, 1, 0, 1, 1 }, /* alive can go S_ACRND_* state */
-	{ 0, 0, 1, 1, 1, 1, 1, 1 }, /* shutdown can go upper states */
-	{ 1, 0, 0, 1, 1, 1, 1, 1 }, /* delay can go upper states, or default (shutdown refuse) */
-	{ 0, 0, 0, 0, 1, 1, 0, 0 }, /* acrnd shutdown can go ioc_shutdown */
-	{ 1, 0, 0, 0, 0, 1, 0, 0 }, /* ioc_shutdown can go default (s3 case) */
-	{ 0, 0, 0, 0, 0, 1, 1, 0 }, /* acrnd_reboot can only go ioc_shutdown */
-	{ 0, 0, 0, 0, 0, 1, 0, 1 }, /* acrnd_suspend can go ioc_shutdown */
+/* state machine valid transition table, one bit per target state */
+#define T(s) (1u << (s))
+#define VALID_DEFAULT		/* default can go alive or shutdown */ \
+	(T(S_DEFAULT) | T(S_ALIVE) | T(S_SHUTDOWN))
+#define VALID_ALIVE		/* alive can go S_ACRND_* state */ \
+	(T(S_ALIVE) | T(S_SHUTDOWN) | T(S_ACRND_SHUTDOWN) | T(S_ACRND_REBOOT) | T(S_ACRND_SUSPEND))
+#define VALID_SHUTDOWN		/* shutdown can go upper states */ \
+	(T(S_SHUTDOWN) | T(S_SHUTDOWN_DELAY) | T(S_ACRND_SHUTDOWN) | T(S_IOC_SHUTDOWN) | \
+	 T(S_ACRND_REBOOT) | T(S_ACRND_SUSPEND))
+#define VALID_SHUTDOWN_DELAY	/* delay can go upper states, or default (shutdown refuse) */ \
+	(T(S_DEFAULT) | T(S_SHUTDOWN_DELAY) | T(S_ACRND_SHUTDOWN) | T(S_IOC_SHUTDOWN) | \
+	 T(S_ACRND_REBOOT) | T(S_ACRND_SUSPEND))
+#define VALID_ACRND_SHUTDOWN	/* acrnd shutdown can go ioc_shutdown */ \
+	(T(S_ACRND_SHUTDOWN) | T(S_IOC_SHUTDOWN))
+#define VALID_IOC_SHUTDOWN	/* ioc_shutdown can go default (s3 case) */ \
+	(T(S_DEFAULT) | T(S_IOC_SHUTDOWN))
+#define VALID_ACRND_REBOOT	/* acrnd_reboot can only go ioc_shutdown */ \
+	(T(S_IOC_SHUTDOWN) | T(S_ACRND_REBOOT))
+#define VALID_ACRND_SUSPEND	/* acrnd_suspend can go ioc_shutdown */ \
+	(T(S_IOC_SHUTDOWN) | T(S_ACRND_SUSPEND))
+
+static const uint8_t valid_map[S_MAX] = {
+	[S_DEFAULT] = VALID_DEFAULT,
+	[S_ALIVE] = VALID_ALIVE,
+	[S_SHUTDOWN] = VALID_SHUTDOWN,
+	[S_SHUTDOWN_DELAY] = VALID_SHUTDOWN_DELAY,
+	[S_ACRND_SHUTDOWN] = VALID_ACRND_SHUTDOWN,
+	[S_IOC_SHUTDOWN] = VALID_IOC_SHUTDOWN,
+	[S_ACRND_REBOOT] = VALID_ACRND_REBOOT,
+	[S_ACRND_SUSPEND] = VALID_ACRND_SUSPEND,
+};
+
+/*
+ * Checked at build time: every state is reachable from default (forward
+ * closure), and default is reachable from every state, so there is no
+ * dead state (backward closure). S_MAX - 1 steps reach the fixed point.
+ */
+#define ALL_STATES (T(S_MAX) - 1)
+#define FWD(r) ((r) | (((r) & T(S_DEFAULT)) ? VALID_DEFAULT : 0) | \
+	(((r) & T(S_ALIVE)) ? VALID_ALIVE : 0) | (((r) & T(S_SHUTDOWN)) ? VALID_SHUTDOWN : 0) | \
+	(((r) & T(S_SHUTDOWN_DELAY)) ? VALID_SHUTDOWN_DELAY : 0) | \
+	(((r) & T(S_ACRND_SHUTDOWN)) ? VALID_ACRND_SHUTDOWN : 0) | \
+	(((r) & T(S_IOC_SHUTDOWN)) ? VALID_IOC_SHUTDOWN : 0) | \
+	(((r) & T(S_ACRND_REBOOT)) ? VALID_ACRND_REBOOT : 0) | \
+	(((r) & T(S_ACRND_SUSPEND)) ? VALID_ACRND_SUSPEND : 0))
+#define BWD(r) ((r) | ((VALID_DEFAULT & (r)) ? T(S_DEFAULT) : 0) | \
+	((VALID_ALIVE & (r)) ? T(S_ALIVE) : 0) | ((VALID_SHUTDOWN & (r)) ? T(S_SHUTDOWN) : 0) | \
+	((VALID_SHUTDOWN_DELAY & (r)) ? T(S_SHUTDOWN_DELAY) : 0) | \
+	((VALID_ACRND_SHUTDOWN & (r)) ? T(S_ACRND_SHUTDOWN) : 0) | \
+	((VALID_IOC_SHUTDOWN & (r)) ? T(S_IOC_SHUTDOWN) : 0) | \
+	((VALID_ACRND_REBOOT & (r)) ? T(S_ACRND_REBOOT) : 0) | \
+	((VALID_ACRND_SUSPEND & (r)) ? T(S_ACRND_SUSPEND) : 0))
+enum {
+	FWD0 = T(S_DEFAULT), FWD1 = FWD(FWD0), FWD2 = FWD(FWD1), FWD3 = FWD(FWD2),
+	FWD4 = FWD(FWD3), FWD5 = FWD(FWD4), FWD6 = FWD(FWD5), FWD7 = FWD(FWD6),
+	BWD0 = T(S_DEFAULT), BWD1 = BWD(BWD0), BWD2 = BWD(BWD1), BWD3 = BWD(BWD2),
+	BWD4 = BWD(BWD3), BWD5 = BWD(BWD4), BWD6 = BWD(BWD5), BWD7 = BWD(BWD6),
 };
+_Static_assert(S_MAX == 8 && S_MAX <= 8 * sizeof(valid_map[0]), "closure depth and mask width");
+_Static_assert(FWD7 == ALL_STATES, "state not reachable from default");
+_Static_assert(BWD7 == ALL_STATES, "dead state, default not reachable from it");
 
 const char *state_name[] = {
 	"default",
@@ -101,18 +179,21 @@ const char *state_name[] = {
 	"acrnd_suspend",
 };
 
-static state_machine_t state;
-static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
-static sem_t event_sema;
+/*
+ * Lock free, updated by compare and swap in state_transit(): the state in
+ * the low byte, above it a sequence number bumped by each transition.
+ */
+#define STATE_BITS 8
+#define STATE_MASK ((1u << STATE_BITS) - 1)
+_Static_assert(S_MAX <= STATE_MASK + 1, "state does not fit the state word");
+static _Atomic uint32_t state = S_DEFAULT;
+static int event_fd = -1;
 
 typedef struct {
 	uint8_t header;
 	uint8_t wakeup[3];
 } __attribute__((packed)) wakeup_reason_frame;
 
-typedef pthread_t cbc_thread_t;
-typedef void* (*cbc_thread_func_t)(void *arg);
-
 //static char cbc_suppress_heartbeat_1min[] =	{0x04, 0x60, 0xEA, 0x00};
 static char cbc_suppress_heartbeat_5min[] =	{0x04, 0xE0, 0x93, 0x04};
 //static char cbc_suppress_heartbeat_10min[] =	{0x04, 0xC0, 0x27, 0x09};
@@ -129,7 +210,6 @@ static char cbc_heartbeat_active[] =		{0x02, 0x01, 0x00, 0x00};
 static char cbc_heartbeat_shutdown_delay[] =	{0x02, 0x02, 0x00, 0x00};
 static char cbc_heartbeat_init[] = 		{0x02, 0x03, 0x00, 0x00};
 static char cbc_heartbeat_rtc[] =		{0x05, 0x00, 0x00, 0x00};
-static int cbc_rtc_set;
 
 static int cbc_lifecycle_fd = -1;
 
@@ -211,197 +291,1223 @@ static int cbc_read_data(int fd, char *payload, int len)
 	return nbytes;
 }
 
-static __inline__ int cbc_thread_create(cbc_thread_t *pthread,
-		cbc_thread_func_t start, void *arg)
+static uint64_t cbc_now_us(void)
 {
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	struct timespec ts;
 
-	return pthread_create(pthread, (const pthread_attr_t *)&attr,
-			start, arg);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
 }
 
-state_machine_t get_state(void)
+static uint64_t cbc_now_ms(void)
 {
-	state_machine_t _state;
-	pthread_mutex_lock(&state_mutex);
-	_state = state;
-	pthread_mutex_unlock(&state_mutex);
-	return _state;
+	return cbc_now_us() / 1000;
 }
 
-state_machine_t state_transit(state_machine_t new)
+#define HEARTBEAT_INTERVAL_MS 1000
+
+/*
+ * Transition tracer: a ring of the latest lifecycle events, and latency
+ * histograms of the shutdown and resume phases derived from them.
+ */
+#define TRACE_RING 1024
+#define TRACE_BUCKETS 16		/* log2 ms, the last one is >= 16 s */
+
+typedef enum {
+	TR_TRANSIT,		/* a: old state, b: new state, seq: transition number */
+	TR_WAKEUP,		/* a: wakeup reason */
+	TR_ACRND_REQ,		/* a: msgid */
+	TR_ACRND_ACK,		/* a: msgid, b: -1 if failed */
+	TR_HEARTBEAT,		/* a: heartbeat frame, b: 1 if sent by the period timer */
+	TR_SLEEP,		/* a: 1 pre, 0 post */
+	TR_EXEC,		/* a: 0 suspend, 1 shutdown, 2 reboot */
+	TR_RTC,			/* a: wakeup in seconds, b: timers served */
+	TR_RTC_FIRED,		/* a: timers fired */
+} trace_type_t;
+
+static const char *trace_type_name[] = {
+	"transit", "wakeup", "acrnd_req", "acrnd_ack", "heartbeat", "sleep", "exec",
+	"rtc", "rtc_fired",
+};
+
+struct trace_rec {
+	uint64_t ts;		/* us, CLOCK_MONOTONIC */
+	uint32_t type;
+	int32_t a;
+	int32_t b;
+	uint32_t seq;
+};
+
+typedef enum {
+	PH_STOP_ACK,		/* IOC shutdown -> ACRND_STOP ack */
+	PH_ACRND_DECISION,	/* IOC shutdown -> acrnd shutdown/suspend/reboot request */
+	PH_IOC_OFF,		/* acrnd request -> IOC wakeup reason off */
+	PH_EXEC,		/* IOC off -> systemctl/shutdown/reboot invoked */
+	PH_SHUTDOWN_TOTAL,	/* IOC shutdown -> invoked */
+	PH_RESUME_ALIVE,	/* sleep hook post -> keep_alive */
+	PH_RESUME_ACK,		/* keep_alive -> ACRND_RESUME ack */
+	PH_MAX,
+} trace_phase_t;
+
+static const char *trace_phase_name[] = {
+	"stop_ack", "acrnd_decision", "ioc_off", "exec", "shutdown_total",
+	"resume_alive", "resume_ack",
+};
+
+struct trace_hist {
+	unsigned long count;
+	uint64_t sum, min, max;		/* us */
+	unsigned long buckets[TRACE_BUCKETS];
+};
+
+/*
+ * Spacing of consecutive heartbeat writes, reset when heartbeats stop on
+ * purpose (suspend, shutdown). The lateness of the periodic ones against
+ * HEARTBEAT_INTERVAL_MS goes to log2 buckets from 16 us.
+ */
+#define HB_INTERVAL_US (HEARTBEAT_INTERVAL_MS * 1000)
+#define HB_LATE_US 100000
+#define HB_BUCKET_MIN_US 16
+
+struct trace_hb {
+	unsigned long count, late;
+	uint64_t sum, max, last;	/* us */
+	unsigned long buckets[TRACE_BUCKETS];
+};
+
+static struct trace_rec trace_ring[TRACE_RING];
+static unsigned int trace_head;
+static struct trace_hist trace_hists[PH_MAX];
+static struct trace_hb trace_hb;
+/* start of the running phases, 0 if none */
+static uint64_t trace_t_shutdown, trace_t_acrnd, trace_t_ioc_off, trace_t_resume, trace_t_alive;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* called with trace_mutex held */
+static void trace_hist_add(trace_phase_t ph, uint64_t start, uint64_t end)
 {
-	state_machine_t _state;
-	pthread_mutex_lock(&state_mutex);
-
-	_state = state;
-	if (valid_map[state][new]) {
-		state = new;
-		pthread_mutex_unlock(&state_mutex);
-		if (_state != new) {
-			fprintf(stderr, "transit (%s to %s)\n",
-				state_name[_state], state_name[new]);
-			_state = new;
+	struct trace_hist *h = &trace_hists[ph];
+	uint64_t us = end - start, ms = us / 1000;
+	int b = 0;
+
+	if (!start)
+		return;
+	while (ms && b < TRACE_BUCKETS - 1) {
+		ms >>= 1;
+		b++;
+	}
+	h->buckets[b]++;
+	if (!h->count || us < h->min)
+		h->min = us;
+	if (us > h->max)
+		h->max = us;
+	h->sum += us;
+	h->count++;
+}
+
+/* called with trace_mutex held */
+static void trace_hb_add(uint64_t ts, int periodic)
+{
+	struct trace_hb *h = &trace_hb;
+	uint64_t us = ts - h->last, late;
+	int b = 0;
+
+	if (h->last) {
+		h->count++;
+		h->sum += us;
+		if (us > h->max)
+			h->max = us;
+		if (us > HB_INTERVAL_US + HB_LATE_US)
+			h->late++;
+		if (periodic) {
+			late = us > HB_INTERVAL_US ? (us - HB_INTERVAL_US) / HB_BUCKET_MIN_US : 0;
+			while (late && b < TRACE_BUCKETS - 1) {
+				late >>= 1;
+				b++;
+			}
+			h->buckets[b]++;
 		}
-	} else {
-		pthread_mutex_unlock(&state_mutex);
 	}
-	return _state;
+	h->last = ts;
 }
 
-static int send_acrnd_stop(void);
-static int send_acrnd_start(void);
+static void trace_add_seq(trace_type_t type, int a, int b, uint32_t seq)
+{
+	uint64_t ts = cbc_now_us();
+	struct trace_rec *r;
+
+	pthread_mutex_lock(&trace_mutex);
+	r = &trace_ring[trace_head++ % TRACE_RING];
+	r->ts = ts;
+	r->type = type;
+	r->a = a;
+	r->b = b;
+	r->seq = seq;
+	switch (type) {
+	case TR_TRANSIT:
+		if (b == S_SHUTDOWN) {
+			trace_t_shutdown = ts;
+		} else if (b == S_ACRND_SHUTDOWN || b == S_ACRND_SUSPEND || b == S_ACRND_REBOOT) {
+			trace_hist_add(PH_ACRND_DECISION, trace_t_shutdown, ts);
+			trace_t_acrnd = ts;
+		} else if (b == S_IOC_SHUTDOWN) {
+			trace_hist_add(PH_IOC_OFF, trace_t_acrnd, ts);
+			trace_t_ioc_off = ts;
+		} else if (b == S_ALIVE) {
+			trace_hist_add(PH_RESUME_ALIVE, trace_t_resume, ts);
+			trace_t_resume = 0;
+			trace_t_alive = ts;
+		}
+		break;
+	case TR_ACRND_ACK:
+		if (a == ACRND_STOP && b != -1)
+			trace_hist_add(PH_STOP_ACK, trace_t_shutdown, ts);
+		if (a == ACRND_RESUME && b != -1) {
+			trace_hist_add(PH_RESUME_ACK, trace_t_alive, ts);
+			trace_t_alive = 0;
+		}
+		break;
+	case TR_SLEEP:
+		if (!a)
+			trace_t_resume = ts;
+		break;
+	case TR_HEARTBEAT:
+		trace_hb_add(ts, b);
+		break;
+	case TR_EXEC:
+		trace_hb.last = 0;
+		trace_hist_add(PH_EXEC, trace_t_ioc_off, ts);
+		trace_hist_add(PH_SHUTDOWN_TOTAL, trace_t_shutdown, ts);
+		trace_t_shutdown = trace_t_acrnd = trace_t_ioc_off = 0;
+		break;
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&trace_mutex);
+}
 
-#define RETRY_CNT 5
-void *cbc_heartbeat_loop(void)
+static void trace_add(trace_type_t type, int a, int b)
 {
-	struct timespec ts;
-	state_machine_t last_state = S_DEFAULT;
-	const int p_size = sizeof(cbc_heartbeat_init);
-	int start_retry = 0;
-	int stop_retry = 0;
-	int default_cnt = 0;
-	int system_rc = 0;
+	trace_add_seq(type, a, b, 0);
+}
 
-	cbc_send_data(cbc_lifecycle_fd, cbc_heartbeat_init, p_size);
-	fprintf(stderr, "send heartbeat init\n");
+/* copy of the tracer taken by trace_dump(), the file is written without the lock */
+struct trace_snap {
+	struct trace_rec ring[TRACE_RING];
+	unsigned int head;
+	struct trace_hist hists[PH_MAX];
+	struct trace_hb hb;
+};
 
-	while (1) {
-		char *heartbeat = NULL;
-		state_machine_t cur_state = get_state();
-
-		switch (cur_state) {
-		case S_DEFAULT:
-			if (last_state != S_DEFAULT)
-				default_cnt = 0;
-			if (default_cnt++) {
-				heartbeat = cbc_heartbeat_init;
-				fprintf(stderr, "send heartbeat init\n");
-			}
-			start_retry = 0;
-			break;
-		case S_ALIVE:
-			if (last_state != S_ALIVE)
-				up_wakeup_reason = wakeup_reason;
-			if ((last_state != S_ALIVE) || (start_retry > 0)) {
-				if (send_acrnd_start() == -1) {
-					if (!start_retry)
-						start_retry = RETRY_CNT;
-					else
-						start_retry--;
-				} else {
-					start_retry = 0;
-				}
-			}
-			heartbeat = cbc_heartbeat_active;
-			break;
-		case S_SHUTDOWN:
-			/* when ACRND detects our off request, we must wait if
-			 * UOS really accept the requst, thus we send shutdown
-			 * delay */
-			cur_state = state_transit(S_SHUTDOWN_DELAY);
-			if (cur_state != S_SHUTDOWN_DELAY)// race condition !
+static int trace_dump(const char *path)
+{
+	struct trace_snap *snap = malloc(sizeof(*snap));
+	struct trace_hist *h;
+	struct trace_rec *r;
+	unsigned int i;
+	FILE *file;
+	int b;
+
+	if (!snap) {
+		fprintf(stderr, "%s no memory\n", __func__);
+		return -1;
+	}
+	pthread_mutex_lock(&trace_mutex);
+	memcpy(snap->ring, trace_ring, sizeof(trace_ring));
+	snap->head = trace_head;
+	memcpy(snap->hists, trace_hists, sizeof(trace_hists));
+	snap->hb = trace_hb;
+	pthread_mutex_unlock(&trace_mutex);
+
+	file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "cannot open %s %d\n", path, errno);
+		free(snap);
+		return -1;
+	}
+	fprintf(file, "# phase count min_ms mean_ms max_ms | <1 <2 <4 ... ms\n");
+	for (i = 0; i < PH_MAX; i++) {
+		h = &snap->hists[i];
+		fprintf(file, "%s %lu %.1f %.1f %.1f |", trace_phase_name[i], h->count,
+			h->min / 1000.0, h->count ? h->sum / 1000.0 / h->count : 0.0,
+			h->max / 1000.0);
+		for (b = 0; b < TRACE_BUCKETS; b++)
+			fprintf(file, " %lu", h->buckets[b]);
+		fprintf(file, "\n");
+	}
+	fprintf(file, "# heartbeat count mean_ms max_ms late_%d_ms | late <%d <%d <%d ... us\n",
+		HB_LATE_US / 1000, HB_BUCKET_MIN_US, HB_BUCKET_MIN_US * 2, HB_BUCKET_MIN_US * 4);
+	fprintf(file, "heartbeat %lu %.1f %.1f %lu |", snap->hb.count,
+		snap->hb.count ? snap->hb.sum / 1000.0 / snap->hb.count : 0.0,
+		snap->hb.max / 1000.0, snap->hb.late);
+	for (b = 0; b < TRACE_BUCKETS; b++)
+		fprintf(file, " %lu", snap->hb.buckets[b]);
+	fprintf(file, "\n");
+	fprintf(file, "# seconds event args\n");
+	for (i = snap->head > TRACE_RING ? snap->head - TRACE_RING : 0; i < snap->head; i++) {
+		r = &snap->ring[i % TRACE_RING];
+		fprintf(file, "%llu.%06llu %s", (unsigned long long)(r->ts / 1000000),
+			(unsigned long long)(r->ts % 1000000), trace_type_name[r->type]);
+		if (r->type == TR_TRANSIT)
+			fprintf(file, " %s %s %u\n", state_name[r->a], state_name[r->b], r->seq);
+		else if (r->type == TR_ACRND_ACK)
+			fprintf(file, " 0x%x %d\n", r->a, r->b);
+		else
+			fprintf(file, " 0x%x\n", r->a);
+	}
+	fclose(file);
+	free(snap);
+	return 0;
+}
+
+/* wake up the event loop for an immediate heartbeat */
+static void cbc_event_post(void)
+{
+	uint64_t one = 1;
+
+	if (write(event_fd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "%s issue %d\n", __func__, errno);
+}
+
+/*
+ * Run a command without shell, return its exit code. With out, its
+ * stdout is read until EOF before it is reaped, up to size - 1 bytes
+ * are kept. The signals blocked for the signalfd are unblocked in it.
+ */
+static int cbc_spawn(char *const argv[], char *out, size_t size)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	char drop[256];
+	int pfd[2] = { -1, -1 };
+	int status, ret;
+	size_t len = 0;
+	ssize_t n;
+	pid_t pid;
+
+	if (out && pipe2(pfd, O_CLOEXEC) < 0)
+		return -1;
+	posix_spawn_file_actions_init(&fa);
+	if (out)
+		posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	ret = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (out)
+		close(pfd[1]);
+	if (ret) {
+		fprintf(stderr, "%s %s issue %d\n", __func__, argv[0], ret);
+		if (out)
+			close(pfd[0]);
+		return -1;
+	}
+	if (out) {
+		while ((n = read(pfd[0], len < size - 1 ? out + len : drop,
+				len < size - 1 ? size - 1 - len : sizeof(drop))) != 0) {
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
 				break;
-			if (send_acrnd_stop() == -1)
-				stop_retry = RETRY_CNT;
-			else
-				stop_retry = 0;
-			// falling through
-		case S_SHUTDOWN_DELAY:
-			if (stop_retry > 0) {
-				if (send_acrnd_stop() == -1) {
-					stop_retry--;
-					if (!stop_retry) {
-						fprintf(stderr, "no one handle our stop request, assume suspend\n");
-						state_transit(S_ACRND_SUSPEND);
-						continue;
-					}
-				} else {
-					stop_retry = 0;
-				}
 			}
-			heartbeat = cbc_heartbeat_shutdown_delay;
-			break;
-		case S_ACRND_SHUTDOWN:
-			heartbeat = cbc_heartbeat_shutdown;
-			break;
-		case S_ACRND_REBOOT:
-			heartbeat = cbc_heartbeat_reboot;
-			break;
-		case S_ACRND_SUSPEND:
-			heartbeat = cbc_heartbeat_s3;
-			break;
-		case S_IOC_SHUTDOWN:
-			if (last_state == S_ACRND_SHUTDOWN) {
-				system_rc = system("shutdown 0");
-				while (1) sleep(1);
-			} else if (last_state == S_ACRND_REBOOT) {
-				system_rc = system("reboot");
-				while (1) sleep(1);
-			} else if (last_state == S_ACRND_SUSPEND) {
-				if (cbc_rtc_set) {
-					cbc_send_data(cbc_lifecycle_fd,
-						cbc_heartbeat_rtc, p_size);
-					cbc_rtc_set = 0;
-				}
-				system_rc = system("systemctl suspend");
+			if (len < size - 1)
+				len += n;
+		}
+		out[len] = 0;
+		close(pfd[0]);
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+enum {
+	SLEEP_NONE,
+	SLEEP_REQUESTED,	/* suspend requested, hook "pre" not seen yet */
+	SLEEP_ENTERED,		/* between hook "pre" and "post" */
+	SLEEP_RESUMED,		/* "post" seen, cbc_heartbeat_step() cleans up */
+};
+static int sleep_phase;
+static uint64_t sleep_deadline;
+/* without any "pre" (hook not installed, suspend refused), stop waiting */
+#define SLEEP_PRE_TIMEOUT_MS 5000
+
+static void cbc_sleep_event(const char *ev)
+{
+	fprintf(stderr, "sleep %s\n", ev);
+	trace_add(TR_SLEEP, !strcmp(ev, "pre"), 0);
+	if (!strcmp(ev, "pre")) {
+		if (sleep_phase == SLEEP_REQUESTED)
+			sleep_phase = SLEEP_ENTERED;
+	} else if (!strcmp(ev, "post")) {
+		sleep_phase = SLEEP_RESUMED;
+	}
+}
+
+static int cbc_sleep_fifo_open(void)
+{
+	int fd;
+
+	if (mkfifo(cbc_sleep_fifo, 0600) < 0 && errno != EEXIST) {
+		fprintf(stderr, "cannot create %s %d\n", cbc_sleep_fifo, errno);
+		return -1;
+	}
+	/* read-write, so the FIFO never reports EOF once the hook closes it */
+	fd = open(cbc_sleep_fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		fprintf(stderr, "cannot open %s %d\n", cbc_sleep_fifo, errno);
+	return fd;
+}
+
+static void cbc_sleep_fifo_read(int fd)
+{
+	char buf[64];
+	char *line, *save;
+	int len;
+
+	while ((len = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[len] = 0;
+		for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+			cbc_sleep_event(line);
+	}
+}
+
+#ifdef WITH_SDBUS
+static sd_bus *bus;
+
+static int on_prepare_for_sleep(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	int start;
+
+	if (sd_bus_message_read(m, "b", &start) >= 0)
+		cbc_sleep_event(start ? "pre" : "post");
+	return 0;
+}
+
+static int cbc_bus_open(void)
+{
+	if (sd_bus_open_system(&bus) < 0) {
+		fprintf(stderr, "cannot open system bus\n");
+		bus = NULL;
+		return -1;
+	}
+	if (sd_bus_match_signal(bus, NULL, "org.freedesktop.login1",
+			"/org/freedesktop/login1", "org.freedesktop.login1.Manager",
+			"PrepareForSleep", on_prepare_for_sleep, NULL) < 0)
+		fprintf(stderr, "cannot watch PrepareForSleep\n");
+	return sd_bus_get_fd(bus);
+}
+
+static void cbc_bus_process(void)
+{
+	while (sd_bus_process(bus, NULL) > 0)
+		;
+}
+#endif
+
+static int cbc_suspend(void)
+{
+	char *argv[] = { "systemctl", "suspend", NULL };
+#ifdef WITH_SDBUS
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	int ret;
+
+	if (bus) {
+		ret = sd_bus_call_method(bus, "org.freedesktop.login1",
+			"/org/freedesktop/login1", "org.freedesktop.login1.Manager",
+			"Suspend", &error, NULL, "b", 0);
+		sd_bus_error_free(&error);
+		/* PrepareForSleep may be queued meanwhile, the fd does not tell */
+		cbc_bus_process();
+		return ret < 0 ? ret : 0;
+	}
+#endif
+	return cbc_spawn(argv, NULL, 0);
+}
+
+/* the queued systemd job taking the system down: "reboot", "poweroff" or NULL */
+static const char *cbc_shutdown_job(void)
+{
+	char *argv[] = { "systemctl", "list-jobs", "--no-legend", "--plain", NULL };
+	static char buf[4096];
+
+#ifdef WITH_SDBUS
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *reply = NULL;
+	const char *unit, *type, *job_state, *job, *unit_path;
+	const char *ret = NULL;
+	uint32_t id;
+
+	if (bus && sd_bus_call_method(bus, "org.freedesktop.systemd1",
+			"/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager",
+			"ListJobs", &error, &reply, NULL) >= 0) {
+		if (sd_bus_message_enter_container(reply, 'a', "(usssoo)") >= 0)
+			while (!ret && sd_bus_message_read(reply, "(usssoo)", &id, &unit,
+					&type, &job_state, &job, &unit_path) > 0) {
+				if (!strcmp(unit, "reboot.target"))
+					ret = "reboot";
+				else if (!strcmp(unit, "poweroff.target"))
+					ret = "poweroff";
 			}
-			fprintf(stderr, "shutdown exec rc %d\n", system_rc);
-			state_transit(S_DEFAULT);// for s3 case
-			while (get_state() == S_DEFAULT && // already wakeup or
-				!system("systemctl list-jobs suspend.target | grep suspend")) //not in suspend process
-				usleep(10000);
-			up_wakeup_reason = 0; // reset up wakeup reason
+		sd_bus_message_unref(reply);
+		sd_bus_error_free(&error);
+		return ret;
+	}
+	sd_bus_error_free(&error);
+#endif
+	/* one systemctl, no shell or grep */
+	if (cbc_spawn(argv, buf, sizeof(buf)) < 0)
+		return NULL;
+	if (strstr(buf, "reboot.target"))
+		return "reboot";
+	if (strstr(buf, "poweroff.target"))
+		return "poweroff";
+	return NULL;
+}
+
+state_machine_t get_state(void)
+{
+	return atomic_load_explicit(&state, memory_order_acquire) & STATE_MASK;
+}
+
+/*
+ * Called after each successful transition, by the thread which made it.
+ * Hooks of concurrent transitions may run in any order, seq tells the
+ * order of the transitions.
+ */
+typedef void (*transit_hook_t)(state_machine_t from, state_machine_t to, uint32_t seq);
+
+static void transit_log(state_machine_t from, state_machine_t to, uint32_t seq)
+{
+	fprintf(stderr, "transit %u (%s to %s)\n", seq, state_name[from], state_name[to]);
+}
+
+static void transit_trace(state_machine_t from, state_machine_t to, uint32_t seq)
+{
+	trace_add_seq(TR_TRANSIT, from, to, seq);
+}
+
+static const transit_hook_t transit_hooks[] = {
+	transit_log,
+	transit_trace,
+};
+
+/* return the new state, or the current one if the transition is invalid */
+state_machine_t state_transit(state_machine_t new)
+{
+	uint32_t old = atomic_load_explicit(&state, memory_order_acquire), word;
+	state_machine_t _state;
+	unsigned int i;
+
+	do {
+		_state = old & STATE_MASK;
+		if (!(valid_map[_state] & T(new)))
+			return _state;
+		if (_state == new)
+			return new;
+		word = (old & ~STATE_MASK) + (1u << STATE_BITS) + new;
+	} while (!atomic_compare_exchange_weak_explicit(&state, &old, word,
+			memory_order_acq_rel, memory_order_acquire));
+	for (i = 0; i < sizeof(transit_hooks) / sizeof(transit_hooks[0]); i++)
+		transit_hooks[i](_state, new, word >> STATE_BITS);
+	return new;
+}
+
+static void send_acrnd_request(unsigned msgid, int retry);
+
+#define RETRY_CNT 5
+#define MAX_EVENTS 8
+
+static int loop_fd = -1;
+static int hb_periodic;		/* the heartbeat step runs from the period timer */
+static int force_s5;
+static state_machine_t last_state = S_DEFAULT;
+static int start_retry;
+static int stop_retry;
+
+/*
+ * Persistent client connection to acrnd. Requests are written without
+ * waiting, the acks are read on the event loop, so a slow acrnd never
+ * delays a heartbeat. The connection is retried with an exponential
+ * backoff and dropped when an ack times out.
+ */
+#define ACRND_ACK_TIMEOUT_MS 2000
+#define ACRND_BACKOFF_MIN_MS 100
+#define ACRND_BACKOFF_MAX_MS 5000
+
+struct acrnd_request {
+	unsigned msgid;			/* 0 if none is pending */
+	unsigned long timestamp;
+	uint64_t deadline;
+	int retry;
+};
+
+static int acrnd_fd = -1;
+static int acrnd_backoff;
+static uint64_t acrnd_retry_at;
+static struct acrnd_request acrnd_requests[2];	/* ACRND_RESUME and ACRND_STOP */
+static struct mngr_msg acrnd_ack;
+static size_t acrnd_ack_len;
+
+/* a request completed, ret -1 if it failed */
+static void acrnd_result(struct acrnd_request *r, int ret)
+{
+	unsigned msgid = r->msgid;
+	int *retry = msgid == ACRND_RESUME ? &start_retry : &stop_retry;
+
+	trace_add(TR_ACRND_ACK, msgid, ret == -1 ? -1 : 0);
+	r->msgid = 0;
+	if (ret != -1) {
+		*retry = 0;
+		return;
+	}
+	if (!r->retry) {
+		*retry = RETRY_CNT;
+		return;
+	}
+	if (*retry > 0)
+		(*retry)--;
+	if (msgid == ACRND_STOP && !*retry && get_state() == S_SHUTDOWN_DELAY) {
+		fprintf(stderr, "no one handle our stop request, assume suspend\n");
+		state_transit(S_ACRND_SUSPEND);
+		cbc_event_post();
+	}
+}
+
+static void acrnd_close(void)
+{
+	int i;
+
+	if (acrnd_fd < 0)
+		return;
+	epoll_ctl(loop_fd, EPOLL_CTL_DEL, acrnd_fd, NULL);
+	mngr_close(acrnd_fd);
+	acrnd_fd = -1;
+	acrnd_ack_len = 0;
+	for (i = 0; i < 2; i++)
+		if (acrnd_requests[i].msgid)
+			acrnd_result(&acrnd_requests[i], -1);
+}
+
+static int acrnd_connect(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	uint64_t now = cbc_now_ms();
+
+	if (acrnd_fd >= 0)
+		return 0;
+	if (now < acrnd_retry_at)
+		return -1;
+	acrnd_fd = mngr_open_un(acrnd_name, MNGR_CLIENT);
+	if (acrnd_fd < 0) {
+		acrnd_backoff = acrnd_backoff ? acrnd_backoff * 2 : ACRND_BACKOFF_MIN_MS;
+		if (acrnd_backoff > ACRND_BACKOFF_MAX_MS)
+			acrnd_backoff = ACRND_BACKOFF_MAX_MS;
+		acrnd_retry_at = now + acrnd_backoff;
+		fprintf(stderr, "cannot open %s socket, retry in %d ms\n", acrnd_name, acrnd_backoff);
+		return -1;
+	}
+	acrnd_backoff = 0;
+	fcntl(acrnd_fd, F_SETFL, fcntl(acrnd_fd, F_GETFL) | O_NONBLOCK);
+	ev.data.fd = acrnd_fd;
+	epoll_ctl(loop_fd, EPOLL_CTL_ADD, acrnd_fd, &ev);
+	return 0;
+}
+
+static void send_acrnd_request(unsigned msgid, int retry)
+{
+	struct acrnd_request *r = &acrnd_requests[msgid == ACRND_RESUME ? 0 : 1];
+	struct mngr_msg req = {
+		.msgid = msgid,
+		.magic = MNGR_MSG_MAGIC,
+	};
+
+	if (r->msgid)		/* still waiting for the ack */
+		return;
+	r->msgid = msgid;
+	r->retry = retry;
+	if (msgid == ACRND_STOP) {
+		req.data.acrnd_stop.force = 0;
+		req.data.acrnd_stop.timeout = 20;
+	}
+	req.timestamp = time(NULL);
+	trace_add(TR_ACRND_REQ, msgid, 0);
+	if (acrnd_connect() < 0) {
+		acrnd_result(r, -1);
+		return;
+	}
+	if (mngr_send_msg(acrnd_fd, &req, NULL, 0) < 0) {
+		fprintf(stderr, "send to %s failed %d\n", acrnd_name, errno);
+		acrnd_close();
+		return;
+	}
+	r->timestamp = req.timestamp;
+	r->deadline = cbc_now_ms() + ACRND_ACK_TIMEOUT_MS;
+}
+
+static void acrnd_read(void)
+{
+	int i, len;
+
+	while (1) {
+		len = read(acrnd_fd, (char *)&acrnd_ack + acrnd_ack_len,
+			sizeof(acrnd_ack) - acrnd_ack_len);
+		if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+			fprintf(stderr, "%s closed the connection\n", acrnd_name);
+			acrnd_close();
+			return;
+		}
+		if (len < 0)
+			return;
+		acrnd_ack_len += len;
+		if (acrnd_ack_len < sizeof(acrnd_ack))
+			continue;
+		acrnd_ack_len = 0;
+		for (i = 0; i < 2; i++) {
+			if (acrnd_requests[i].msgid != acrnd_ack.msgid ||
+			    acrnd_requests[i].timestamp != acrnd_ack.timestamp)
+				continue;
+			fprintf(stderr, "result %d\n", acrnd_ack.data.err);
+			acrnd_result(&acrnd_requests[i], 1);
+		}
+	}
+}
+
+/* ms until the next ack deadline, -1 if none */
+static int acrnd_timeout(void)
+{
+	uint64_t now = cbc_now_ms(), first = 0;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (acrnd_requests[i].msgid && (!first || acrnd_requests[i].deadline < first))
+			first = acrnd_requests[i].deadline;
+	if (!first)
+		return -1;
+	return first > now ? first - now : 0;
+}
+
+static void acrnd_expire(void)
+{
+	uint64_t now = cbc_now_ms();
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (acrnd_requests[i].msgid && acrnd_requests[i].deadline <= now) {
+			fprintf(stderr, "no ack from %s\n", acrnd_name);
+			/* a late ack would be taken for the next request */
+			acrnd_close();
+			return;
+		}
+}
+
+/*
+ * RTC wakeup timers, one per VM: a min-heap on the absolute time, saved
+ * to cbc_rtc_file on every change so a restart of the service keeps
+ * them. On suspend the IOC gets only the earliest deadline, and every
+ * timer due within RTC_COALESCE_S of it is served by the same wakeup.
+ */
+#define RTC_TIMER_MAX 32
+#define RTC_COALESCE_S 60
+
+struct rtc_timer {
+	time_t t;
+	char vmname[MAX_VM_OS_NAME_LEN];
+};
+
+static struct rtc_timer rtc_heap[RTC_TIMER_MAX];
+static int rtc_num;
+static pthread_mutex_t rtc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* finest granularity holding the delta, rounded down so never late */
+static int cbc_timer_format(int *_delta, int *gran)
+{
+	static const int unit[] = { 60, 60, 24, 7 };
+	int delta = *_delta;
+
+	if (delta < 1) {
+		fprintf(stderr, "timer as %d second(s), cannot support.\n", delta);
+		return -1;
+	}
+	for (*gran = 0; delta > 0xFFFF; (*gran)++) {
+		if (*gran == sizeof(unit) / sizeof(unit[0])) {
+			fprintf(stderr, "timer as %d weeks, cannot support.\n", delta);
+			return -1;
+		}
+		delta /= unit[*gran];
+	}
+	*_delta = delta;
+	return 0;
+}
+
+static void rtc_swap(int a, int b)
+{
+	struct rtc_timer tmp = rtc_heap[a];
+
+	rtc_heap[a] = rtc_heap[b];
+	rtc_heap[b] = tmp;
+}
+
+static void rtc_sift(int i)
+{
+	int c;
+
+	while (i > 0 && rtc_heap[i].t < rtc_heap[(i - 1) / 2].t) {
+		rtc_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while ((c = 2 * i + 1) < rtc_num) {
+		if (c + 1 < rtc_num && rtc_heap[c + 1].t < rtc_heap[c].t)
+			c++;
+		if (rtc_heap[i].t <= rtc_heap[c].t)
 			break;
-		default:
-			fprintf(stderr, "unknow state\n");
+		rtc_swap(i, c);
+		i = c;
+	}
+}
+
+static void rtc_remove(int i)
+{
+	rtc_heap[i] = rtc_heap[--rtc_num];
+	if (i < rtc_num)
+		rtc_sift(i);
+}
+
+/* called with rtc_mutex held */
+static void rtc_save(void)
+{
+	char tmp[LCS_PATH_MAX + 4];
+	char *dir = strdup(cbc_rtc_file);
+	FILE *file;
+	int i;
+
+	if (dir && strrchr(dir, '/')) {
+		*strrchr(dir, '/') = 0;
+		mkdir(dir, 0755);
+	}
+	free(dir);
+	snprintf(tmp, sizeof(tmp), "%s.new", cbc_rtc_file);
+	file = fopen(tmp, "w");
+	if (!file) {
+		fprintf(stderr, "cannot write %s %d\n", tmp, errno);
+		return;
+	}
+	for (i = 0; i < rtc_num; i++)
+		fprintf(file, "%ld %s\n", (long)rtc_heap[i].t, rtc_heap[i].vmname);
+	fflush(file);
+	fsync(fileno(file));
+	fclose(file);
+	rename(tmp, cbc_rtc_file);
+}
+
+static void rtc_load(void)
+{
+	FILE *file = fopen(cbc_rtc_file, "r");
+	char line[128];
+	char name[128];
+	long t;
+
+	if (!file)
+		return;
+	pthread_mutex_lock(&rtc_mutex);
+	while (rtc_num < RTC_TIMER_MAX && fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%ld %127s", &t, name) != 2)
+			continue;
+		rtc_heap[rtc_num].t = t;
+		snprintf(rtc_heap[rtc_num].vmname, MAX_VM_OS_NAME_LEN, "%.*s",
+			MAX_VM_OS_NAME_LEN - 1, name);
+		rtc_num++;
+		rtc_sift(rtc_num - 1);
+	}
+	pthread_mutex_unlock(&rtc_mutex);
+	fclose(file);
+}
+
+/* a new request of a VM replaces its previous timer */
+static int rtc_timer_set(const char *vmname, time_t t)
+{
+	int i;
+
+	pthread_mutex_lock(&rtc_mutex);
+	for (i = 0; i < rtc_num; i++)
+		if (!strncmp(rtc_heap[i].vmname, vmname, MAX_VM_OS_NAME_LEN))
 			break;
+	if (i == RTC_TIMER_MAX) {
+		pthread_mutex_unlock(&rtc_mutex);
+		fprintf(stderr, "no room for the rtc timer of %s\n", vmname);
+		return -1;
+	}
+	if (i == rtc_num) {
+		snprintf(rtc_heap[i].vmname, MAX_VM_OS_NAME_LEN, "%.*s",
+			MAX_VM_OS_NAME_LEN - 1, vmname);
+		rtc_num++;
+	}
+	rtc_heap[i].t = t;
+	rtc_sift(i);
+	rtc_save();
+	pthread_mutex_unlock(&rtc_mutex);
+	return 0;
+}
+
+/* set the IOC wakeup to the earliest timer, before a suspend */
+/* drop the timers due by limit, called with rtc_mutex held */
+static int rtc_drop(time_t limit)
+{
+	int fired = 0;
+
+	while (rtc_num && rtc_heap[0].t <= limit) {
+		fprintf(stderr, "rtc timer of %s fired (due at %ld)\n",
+			rtc_heap[0].vmname, (long)rtc_heap[0].t);
+		rtc_remove(0);
+		fired++;
+	}
+	if (fired)
+		rtc_save();
+	return fired;
+}
+
+static void rtc_timer_program(void)
+{
+	time_t now = time(NULL), first;
+	int i, delta, gran, fired, served = 0;
+
+	pthread_mutex_lock(&rtc_mutex);
+	/* expired while the system was up, no wakeup for them */
+	fired = rtc_drop(now);
+	if (!rtc_num) {
+		pthread_mutex_unlock(&rtc_mutex);
+		if (fired)
+			trace_add(TR_RTC_FIRED, fired, 0);
+		return;
+	}
+	first = rtc_heap[0].t;
+	for (i = 0; i < rtc_num; i++)
+		served += rtc_heap[i].t <= first + RTC_COALESCE_S;
+	pthread_mutex_unlock(&rtc_mutex);
+	if (fired)
+		trace_add(TR_RTC_FIRED, fired, 0);
+
+	delta = first - now;
+	if (cbc_timer_format(&delta, &gran) < 0)
+		return;
+	fprintf(stderr, "rtc wakeup in %d unit %d for %d timer(s)\n", delta, gran, served);
+	trace_add(TR_RTC, first - now, served);
+	cbc_heartbeat_rtc[1] = delta & 0xFF;
+	cbc_heartbeat_rtc[2] = (delta & 0xFF00) >> 8;
+	cbc_heartbeat_rtc[3] = gran & 0xF;
+	cbc_send_data(cbc_lifecycle_fd, cbc_heartbeat_rtc, sizeof(cbc_heartbeat_rtc));
+}
+
+/* after a resume, drop and report the timers which are due */
+static void rtc_timer_fired(void)
+{
+	int fired;
+
+	pthread_mutex_lock(&rtc_mutex);
+	fired = rtc_drop(time(NULL) + RTC_COALESCE_S);
+	pthread_mutex_unlock(&rtc_mutex);
+	if (fired)
+		trace_add(TR_RTC_FIRED, fired, 0);
+}
+
+/* send the heartbeat of the current state, return ms to the next one */
+static int cbc_heartbeat_step(void)
+{
+	static int default_cnt;
+	const int p_size = sizeof(cbc_heartbeat_init);
+	int system_rc = 0;
+	char *heartbeat = NULL;
+	state_machine_t cur_state;
+
+	if (sleep_phase != SLEEP_NONE) {
+		/* not resumed, nor woken up by the IOC yet */
+		if (sleep_phase != SLEEP_RESUMED && get_state() == S_DEFAULT) {
+			/* no timer until the hook reports the resume */
+			if (sleep_phase == SLEEP_ENTERED)
+				return -1;
+			if (cbc_now_ms() < sleep_deadline)
+				return sleep_deadline - cbc_now_ms();
+			fprintf(stderr, "no suspend seen\n");
 		}
-		if (heartbeat) {
-			cbc_send_data(cbc_lifecycle_fd, heartbeat, p_size);
-			fprintf(stderr, ".");
+		sleep_phase = SLEEP_NONE;
+		rtc_timer_fired();
+		up_wakeup_reason = 0; // reset up wakeup reason
+		return 0;
+	}
+
+	cur_state = get_state();
+	switch (cur_state) {
+	case S_DEFAULT:
+		if (last_state != S_DEFAULT)
+			default_cnt = 0;
+		if (default_cnt++) {
+			heartbeat = cbc_heartbeat_init;
+			fprintf(stderr, "send heartbeat init\n");
+		}
+		start_retry = 0;
+		break;
+	case S_ALIVE:
+		if (last_state != S_ALIVE)
+			up_wakeup_reason = wakeup_reason;
+		/* the result comes later, see acrnd_result() */
+		if ((last_state != S_ALIVE) || (start_retry > 0))
+			send_acrnd_request(ACRND_RESUME, last_state == S_ALIVE);
+		heartbeat = cbc_heartbeat_active;
+		break;
+	case S_SHUTDOWN:
+		/* when ACRND detects our off request, we must wait if
+		 * UOS really accept the requst, thus we send shutdown
+		 * delay */
+		cur_state = state_transit(S_SHUTDOWN_DELAY);
+		if (cur_state != S_SHUTDOWN_DELAY)// race condition !
+			break;
+		stop_retry = 0;
+		send_acrnd_request(ACRND_STOP, 0);
+		heartbeat = cbc_heartbeat_shutdown_delay;
+		break;
+	case S_SHUTDOWN_DELAY:
+		if (stop_retry > 0)
+			send_acrnd_request(ACRND_STOP, 1);
+		heartbeat = cbc_heartbeat_shutdown_delay;
+		break;
+	case S_ACRND_SHUTDOWN:
+		heartbeat = cbc_heartbeat_shutdown;
+		break;
+	case S_ACRND_REBOOT:
+		heartbeat = cbc_heartbeat_reboot;
+		break;
+	case S_ACRND_SUSPEND:
+		heartbeat = cbc_heartbeat_s3;
+		break;
+	case S_IOC_SHUTDOWN:
+		if (last_state == S_ACRND_SHUTDOWN) {
+			trace_add(TR_EXEC, 1, 0);
+			system_rc = system("shutdown 0");
+			while (1) sleep(1);
+		} else if (last_state == S_ACRND_REBOOT) {
+			trace_add(TR_EXEC, 2, 0);
+			system_rc = system("reboot");
+			while (1) sleep(1);
+		} else if (last_state == S_ACRND_SUSPEND) {
+			rtc_timer_program();
+			sleep_phase = SLEEP_REQUESTED;
+			sleep_deadline = cbc_now_ms() + SLEEP_PRE_TIMEOUT_MS;
+			trace_add(TR_EXEC, 0, 0);
+			system_rc = cbc_suspend();
 		}
+		fprintf(stderr, "shutdown exec rc %d\n", system_rc);
+		state_transit(S_DEFAULT);// for s3 case
 		last_state = cur_state;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		/* delay 1 second to send next heart beat */
-		ts.tv_sec += 1;
-		sem_timedwait(&event_sema, &ts);
+		/* wakeup reasons are still read while waiting for the resume */
+		if (sleep_phase != SLEEP_NONE)
+			return 0;
+		up_wakeup_reason = 0; // reset up wakeup reason
+		return HEARTBEAT_INTERVAL_MS;
+	default:
+		fprintf(stderr, "unknow state\n");
+		break;
 	}
-	return NULL;
+	if (heartbeat) {
+		cbc_send_data(cbc_lifecycle_fd, heartbeat, p_size);
+		trace_add(TR_HEARTBEAT, heartbeat[1] | heartbeat[2] << 8, hb_periodic);
+		fprintf(stderr, ".");
+	}
+	last_state = cur_state;
+	return HEARTBEAT_INTERVAL_MS;
 }
 
-static int force_s5;
-void *cbc_wakeup_reason_thread(void *arg)
+/* return 1 if the wakeup reason changed the state */
+static int cbc_wakeup_reason_read(void)
 {
 	wakeup_reason_frame data;
+	state_machine_t old = get_state();
 	int len;
 
+	len = cbc_read_data(cbc_lifecycle_fd, (char *)&data, sizeof(data));
+	if (len <= 0)
+		return 0;
+	if (data.header == 6) { // TODO: handle logic mode value
+		return 0;
+	}
+	if (data.header != 1) {
+		fprintf(stderr, "received wrong wakeup reason");
+		return 0;
+	}
+	wakeup_reason = data.wakeup[0] | data.wakeup[1] << 8 | data.wakeup[2] << 16;
+	trace_add(TR_WAKEUP, wakeup_reason, 0);
+	if (!wakeup_reason) {
+		state_transit(S_IOC_SHUTDOWN);
+	} else if (!(wakeup_reason & ~(3 << 22))) {
+		state_transit(S_SHUTDOWN);
+		// bit 22 is used by UOC ioc mediator to indicate a S5 is preferred
+		force_s5 = wakeup_reason & (1 << 22);
+	} else {
+		state_transit(S_ALIVE);
+	}
+	return get_state() != old;
+}
+
+/* periodic timer, stopped for ms < 0 */
+static void cbc_timer_arm(int timer_fd, int ms)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (ms > 0) {
+		its.it_interval.tv_sec = its.it_value.tv_sec = ms / 1000;
+		its.it_interval.tv_nsec = its.it_value.tv_nsec = (ms % 1000) * 1000000l;
+	}
+
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+		fprintf(stderr, "%s issue %d\n", __func__, errno);
+}
+
+/*
+ * SIGTERM, read from the signalfd so the systemd query runs on the loop
+ * thread and not inside whatever the signal interrupted.
+ */
+static void cbc_sigterm_suppress(void)
+{
+	const char *job = cbc_shutdown_job();
+
+	if (job && !strcmp(job, "reboot")) {//reboot
+		cbc_send_data(cbc_lifecycle_fd, cbc_suppress_heartbeat_5min,
+			sizeof(cbc_suppress_heartbeat_5min));
+		cbc_send_data(cbc_lifecycle_fd, cbc_heartbeat_reboot,
+			sizeof(cbc_heartbeat_reboot));
+		exit(0);
+	}
+	if (job && !strcmp(job, "poweroff")) {//shutdown
+		cbc_send_data(cbc_lifecycle_fd, cbc_suppress_heartbeat_5min,
+			sizeof(cbc_suppress_heartbeat_5min));
+		cbc_send_data(cbc_lifecycle_fd, cbc_heartbeat_shutdown,
+			sizeof(cbc_heartbeat_shutdown));
+		exit(0);
+	}
+	cbc_send_data(cbc_lifecycle_fd, cbc_suppress_heartbeat_30min,
+			sizeof(cbc_suppress_heartbeat_30min));
+	exit(0);
+}
+
+/*
+ * The timer is periodic, a heartbeat on time does not re-arm it so the
+ * interval does not drift. An event or a new state beats at once and
+ * restarts the period from there.
+ */
+static void cbc_event_loop(void)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	int timer_fd, period, next;
+	int sleep_fd, sig_fd, bus_fd = -1;
+	struct signalfd_siginfo si;
+	sigset_t mask;
+	int i, n, beat, rearm;
+	uint64_t cnt;
+
+	loop_fd = epoll_create1(EPOLL_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop_fd < 0 || timer_fd < 0) {
+		fprintf(stderr, "%s cannot create epoll/timer %d\n", __func__, errno);
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = cbc_lifecycle_fd;
+	epoll_ctl(loop_fd, EPOLL_CTL_ADD, cbc_lifecycle_fd, &ev);
+	ev.data.fd = timer_fd;
+	epoll_ctl(loop_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+	ev.data.fd = event_fd;
+	epoll_ctl(loop_fd, EPOLL_CTL_ADD, event_fd, &ev);
+	/* SIGUSR1 and SIGTERM are blocked in main(), before any thread starts */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGTERM);
+	sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sig_fd >= 0) {
+		ev.data.fd = sig_fd;
+		epoll_ctl(loop_fd, EPOLL_CTL_ADD, sig_fd, &ev);
+	}
+	sleep_fd = cbc_sleep_fifo_open();
+	if (sleep_fd >= 0) {
+		ev.data.fd = sleep_fd;
+		epoll_ctl(loop_fd, EPOLL_CTL_ADD, sleep_fd, &ev);
+	}
+#ifdef WITH_SDBUS
+	bus_fd = cbc_bus_open();
+	if (bus_fd >= 0) {
+		ev.data.fd = bus_fd;
+		epoll_ctl(loop_fd, EPOLL_CTL_ADD, bus_fd, &ev);
+	}
+#endif
+
+	cbc_send_data(cbc_lifecycle_fd, cbc_heartbeat_init, sizeof(cbc_heartbeat_init));
+	trace_add(TR_HEARTBEAT, cbc_heartbeat_init[1] | cbc_heartbeat_init[2] << 8, 0);
+	fprintf(stderr, "send heartbeat init\n");
+	while (!(period = cbc_heartbeat_step()))
+		;
+	cbc_timer_arm(timer_fd, period);
+
 	while (1) {
-		len = cbc_read_data(cbc_lifecycle_fd, (char *)&data, sizeof(data));
-		if (len > 0) {
-			if (data.header == 6) { // TODO: handle logic mode value
-				continue;
-			}
-			if (data.header != 1) {
-				fprintf(stderr, "received wrong wakeup reason");
+		n = epoll_wait(loop_fd, events, MAX_EVENTS, acrnd_timeout());
+		if (n < 0) {
+			if (errno == EINTR)
 				continue;
+			fprintf(stderr, "%s issue %d\n", __func__, errno);
+			break;
+		}
+		beat = rearm = 0;
+		acrnd_expire();
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == timer_fd) {
+				if (read(timer_fd, &cnt, sizeof(cnt)) == sizeof(cnt) && cnt > 1)
+					fprintf(stderr, "%llu heartbeat(s) late\n",
+						(unsigned long long)cnt - 1);
+				beat = 1;
+			} else if (events[i].data.fd == event_fd) {
+				if (read(event_fd, &cnt, sizeof(cnt)) < 0)
+					continue;
+				beat = rearm = 1;
+			} else if (events[i].data.fd == sig_fd) {
+				while (read(sig_fd, &si, sizeof(si)) == sizeof(si))
+					if (si.ssi_signo == SIGTERM)
+						cbc_sigterm_suppress();
+					else if (!trace_dump(cbc_trace_file))
+						fprintf(stderr, "trace written to %s\n", cbc_trace_file);
+			} else if (events[i].data.fd == sleep_fd) {
+				cbc_sleep_fifo_read(sleep_fd);
+				beat = rearm = 1;
+			} else if (events[i].data.fd == acrnd_fd) {
+				acrnd_read();
+			} else if (events[i].data.fd == bus_fd) {
+#ifdef WITH_SDBUS
+				cbc_bus_process();
+#endif
+				beat = rearm = 1;
+			} else if (cbc_wakeup_reason_read()) {
+				beat = rearm = 1;
 			}
-			wakeup_reason = data.wakeup[0] | data.wakeup[1] << 8 | data.wakeup[2] << 16;
-			if (!wakeup_reason) {
-				state_transit(S_IOC_SHUTDOWN);
-				sem_post(&event_sema);
-			} else if (!(wakeup_reason & ~(3 << 22))) {
-				state_transit(S_SHUTDOWN);
-				// bit 22 is used by UOC ioc mediator to indicate a S5 is preferred
-				force_s5 = wakeup_reason & (1 << 22);
-			} else {
-				state_transit(S_ALIVE);
-			}
+		}
+		if (!beat)
+			continue;
+		hb_periodic = !rearm;
+		while (!(next = cbc_heartbeat_step()))
+			;
+		if (rearm || next != period) {
+			period = next;
+			cbc_timer_arm(timer_fd, period);
 		}
 	}
-	return NULL;
+	if (sleep_fd >= 0)
+		close(sleep_fd);
+	if (sig_fd >= 0)
+		close(sig_fd);
+	close(timer_fd);
+	close(loop_fd);
 }
 
 static int cbcd_fd;
@@ -422,7 +1528,7 @@ static void handle_shutdown(struct mngr_msg *msg, int client_fd, void *param)
 		fprintf(stderr, "acrnd agreed to shutdown\n");
 		state_transit(S_ACRND_SHUTDOWN);
 	}
-	sem_post(&event_sema);
+	cbc_event_post();
 	mngr_send_msg(client_fd, &ack, NULL, 0);
 }
 
@@ -442,7 +1548,7 @@ static void handle_suspend(struct mngr_msg *msg, int client_fd, void *param)
 		fprintf(stderr, "acrnd agreed to suspend\n");
 		state_transit(S_ACRND_SUSPEND);
 	}
-	sem_post(&event_sema);
+	cbc_event_post();
 	mngr_send_msg(client_fd, &ack, NULL, 0);
 }
 
@@ -462,7 +1568,7 @@ static void handle_reboot(struct mngr_msg *msg, int client_fd, void *param)
 		fprintf(stderr, "acrnd agreed to reboot\n");
 		state_transit(S_ACRND_REBOOT);
 	}
-	sem_post(&event_sema);
+	cbc_event_post();
 	mngr_send_msg(client_fd, &ack, NULL, 0);
 }
 
@@ -478,52 +1584,6 @@ static void handle_wakeup_reason(struct mngr_msg *msg, int client_fd, void *para
 	mngr_send_msg(client_fd, &ack, NULL, 0);
 }
 
-static int cbc_timer_format(int *_delta, int *gran)
-{
-	int delta = *_delta;
-
-	if (delta < 1) {
-		fprintf(stderr, "timer as %d second(s), cannot support.\n", delta);
-		return -1;
-	}
-	*gran = 0;
-	if (delta > 0xFFFF) {
-		delta /= 60;
-		*gran = 1;
-		goto minute;
-	}
-	goto done;
-minute:
-	if (delta > 0xFFFF) {
-		delta /= 60;
-		*gran = 2;
-		goto hour;
-	}
-	goto done;
-hour:
-	if (delta > 0xFFFF) {
-		delta /= 24;
-		*gran = 3;
-		goto day;
-	}
-	goto done;
-day:
-	if (delta > 0xFFFF) {
-		delta /= 7;
-		*gran = 4;
-		goto week;
-	}
-	goto done;
-week:
-	if (delta > 0xFFFF) {
-		fprintf(stderr, "timer as %d weeks, cannot support.\n", delta);
-		return -1;
-	}
-done:
-	*_delta = delta;
-	return 0;
-}
-
 static void handle_rtc(struct mngr_msg *msg, int client_fd, void *param)
 {
 	struct mngr_msg ack;
@@ -537,71 +1597,30 @@ static void handle_rtc(struct mngr_msg *msg, int client_fd, void *param)
 
 	now = time(NULL);
 	delta = msg->data.rtc_timer.t - now;
-	if (cbc_timer_format(&delta, &gran) < 0) {
+	if (cbc_timer_format(&delta, &gran) < 0 ||
+	    rtc_timer_set(msg->data.rtc_timer.vmname, msg->data.rtc_timer.t) < 0) {
 		ack.data.err = -1;
 	} else {
 		ack.data.err = 0;
 
 		fprintf(stderr, "%s request rtc timer at %lu\n",
 			msg->data.rtc_timer.vmname, msg->data.rtc_timer.t);
-		cbc_heartbeat_rtc[1] = delta & 0xFF;
-		cbc_heartbeat_rtc[2] = (delta & 0xFF00) >> 8;
-		cbc_heartbeat_rtc[3] = gran & 0xF;
-		cbc_rtc_set = 1;
 	}
 	mngr_send_msg(client_fd, &ack, NULL, 0);
 }
 
-static int send_acrnd_start(void)
-{
-	int acrnd_fd;
-	int ret;
-	struct mngr_msg req = {
-		.msgid = ACRND_RESUME,
-		.magic = MNGR_MSG_MAGIC,
-	};
-	struct mngr_msg ack;
+/* private request of the sos-lcs socket: write the trace report */
+#define LCS_TRACE_DUMP 0x5f0
 
-	req.timestamp = time(NULL);
-	acrnd_fd = mngr_open_un(acrnd_name, MNGR_CLIENT);
-	if (acrnd_fd < 0) {
-		fprintf(stderr, "cannot open %s socket\n", acrnd_name);
-		return -1;
-	}
-	ret = mngr_send_msg(acrnd_fd, &req, &ack, 2);
-	if (ret > 0)
-		fprintf(stderr, "result %d\n", ack.data.err);
-	mngr_close(acrnd_fd);
-	return ret;
-}
-
-static int send_acrnd_stop(void)
+static void handle_trace_dump(struct mngr_msg *msg, int client_fd, void *param)
 {
-	int acrnd_fd;
-	int ret;
-	struct mngr_msg req = {
-		.msgid = ACRND_STOP,
-		.magic = MNGR_MSG_MAGIC,
-		.data = {
-			.acrnd_stop = {
-				.force = 0,
-				.timeout = 20,
-				},
-			},
-	};
 	struct mngr_msg ack;
 
-	req.timestamp = time(NULL);
-	acrnd_fd = mngr_open_un(acrnd_name, MNGR_CLIENT);
-	if (acrnd_fd < 0) {
-		fprintf(stderr, "cannot open %s socket\n", acrnd_name);
-		return -1;
-	}
-	ret = mngr_send_msg(acrnd_fd, &req, &ack, 2);
-	if (ret > 0)
-		fprintf(stderr, "result %d\n", ack.data.err);
-	mngr_close(acrnd_fd);
-	return ret;
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+	ack.data.err = trace_dump(cbc_trace_file);
+	mngr_send_msg(client_fd, &ack, NULL, 0);
 }
 
 /* for non vm manager (acrnd) case, we handle the stop request by ourselves */
@@ -658,43 +1677,175 @@ no_match_file:
 	return is_acrn;
 }
 
-static void sigterm_suppress(int sig)
+/* real-time profile of the heartbeat loop, all off by default */
+#define RT_STACK_KB_MAX 4096
+static int cbc_rt_mlock;		/* mlockall() current and future pages */
+static int cbc_rt_stack_kb;		/* stack of the event loop touched up front */
+static int cbc_rt_priority;		/* SCHED_FIFO priority, 0 keeps SCHED_OTHER */
+static unsigned int cbc_rt_cpus;	/* CPU mask of the event loop, 0 keeps all */
+
+/*
+ * Config file, one entry per line:
+ *	option | <name> | <value>
+ * Lines starting with '#' are comments.
+ */
+static void cbc_option_set(const char *name, int val)
 {
-	if (!system("systemctl list-jobs reboot.target | grep reboot")) {//reboot
-		cbc_send_data(cbc_lifecycle_fd, cbc_suppress_heartbeat_5min,
-			sizeof(cbc_suppress_heartbeat_5min));
-		cbc_send_data(cbc_lifecycle_fd, cbc_heartbeat_reboot,
-			sizeof(cbc_heartbeat_reboot));
-		exit(0);
+	if (strcmp(name, "mlock") == 0)
+		cbc_rt_mlock = !!val;
+	else if (strcmp(name, "stack_kb") == 0)
+		cbc_rt_stack_kb = val < 0 ? 0 : val > RT_STACK_KB_MAX ? RT_STACK_KB_MAX : val;
+	else if (strcmp(name, "rt_priority") == 0 && val >= 0 && val <= 99)
+		cbc_rt_priority = val;
+	else if (strcmp(name, "cpu_mask") == 0)
+		cbc_rt_cpus = (unsigned int)val;
+	else
+		fprintf(stderr, "unknown option %s\n", name);
+}
+
+static int cbc_conf_load(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	char line[256];
+	char key[32];
+	char name[64];
+	int val, lineno = 0;
+
+	if (!file)
+		return -1;
+	fprintf(stderr, "load config %s\n", path);
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		if (sscanf(line, "%31s", key) != 1 || key[0] == '#')
+			continue;
+		if (strcmp(key, "option") ||
+		    sscanf(line, "%*s | %63s | %i", name, &val) != 2) {
+			fprintf(stderr, "%s:%d: invalid entry\n", path, lineno);
+			continue;
+		}
+		cbc_option_set(name, val);
 	}
-	if (!system("systemctl list-jobs poweroff.target | grep poweroff")) {//shutdown
-		cbc_send_data(cbc_lifecycle_fd, cbc_suppress_heartbeat_5min,
-			sizeof(cbc_suppress_heartbeat_5min));
-		cbc_send_data(cbc_lifecycle_fd, cbc_heartbeat_shutdown,
-			sizeof(cbc_heartbeat_shutdown));
-		exit(0);
+	fclose(file);
+	return 0;
+}
+
+/* the trace and rtc locks are shared with the libacrn-mngr threads */
+static void cbc_rt_mutex_init(pthread_mutex_t *m)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(m, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void cbc_rt_stack_prefault(int kb)
+{
+	char stack[kb * 1024];
+
+	memset(stack, 0, sizeof(stack));
+	__asm__ __volatile__("" : : "r"(stack) : "memory");	// keep the stores
+}
+
+/* before any thread is started */
+static void cbc_rt_init(void)
+{
+	if (!cbc_rt_priority)
+		return;
+	cbc_rt_mutex_init(&trace_mutex);
+	cbc_rt_mutex_init(&rtc_mutex);
+}
+
+/*
+ * Called by the event loop thread only: the libacrn-mngr threads keep
+ * SCHED_OTHER, and spawned commands (systemctl, shutdown) do not inherit
+ * the real-time policy. Failures are logged, the service runs anyway.
+ */
+static void cbc_rt_setup(void)
+{
+	struct sched_param param = { .sched_priority = cbc_rt_priority };
+	cpu_set_t cpus;
+	unsigned int i;
+
+	if (cbc_rt_mlock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		fprintf(stderr, "mlockall failed, errno %d\n", errno);
+	if (cbc_rt_stack_kb)
+		cbc_rt_stack_prefault(cbc_rt_stack_kb);
+	if (cbc_rt_cpus) {
+		CPU_ZERO(&cpus);
+		for (i = 0; i < 32; i++)
+			if (cbc_rt_cpus & (1u << i))
+				CPU_SET(i, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			fprintf(stderr, "cpu mask 0x%x failed, errno %d\n", cbc_rt_cpus, errno);
 	}
-	cbc_send_data(cbc_lifecycle_fd, cbc_suppress_heartbeat_30min,
-			sizeof(cbc_suppress_heartbeat_30min));
-	exit(0);
+	if (cbc_rt_priority &&
+	    sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) < 0)
+		fprintf(stderr, "SCHED_FIFO %d failed, errno %d\n", cbc_rt_priority, errno);
+	fprintf(stderr, "rt profile: mlock %d stack %dkB priority %d cpus 0x%x\n",
+		cbc_rt_mlock, cbc_rt_stack_kb, cbc_rt_priority, cbc_rt_cpus);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-	cbc_thread_t wakeup_reason_thread_ptr;
-	int is_acrn = check_acrnd();
-	int v_fd;
+	const char *conf = NULL;
+	int is_acrn = -1;
+	sigset_t mask;
+	int c, v_fd = -1;
+
+	while ((c = getopt(argc, argv, "ac:d:r:")) != -1) {
+		switch (c) {
+		case 'a':
+			is_acrn = 1;
+			break;
+		case 'c':
+			conf = optarg;
+			break;
+		case 'd':
+			cbc_lifecycle_dev = optarg;
+			break;
+		case 'r':
+			snprintf(cbc_sleep_fifo, LCS_PATH_MAX, "%s/cbc_lifecycle.sleep", optarg);
+			snprintf(cbc_trace_file, LCS_PATH_MAX, "%s/cbc_lifecycle.trace", optarg);
+			snprintf(cbc_rtc_file, LCS_PATH_MAX, "%s/rtc_timers", optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a] [-c config] [-d device] [-r state directory]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (is_acrn < 0)
+		is_acrn = check_acrnd();
+	if (conf) {
+		if (cbc_conf_load(conf)) {
+			fprintf(stderr, "cannot open config %s\n", conf);
+			return 1;
+		}
+	} else if (cbc_conf_load(LCS_CONF_FILE) && cbc_conf_load(LCS_CONF_DEFAULT_FILE)) {
+		fprintf(stderr, "no config file, real-time profile off\n");
+	}
+	cbc_rt_init();
 
-	sem_init(&event_sema, 0, 0);
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0)
+		goto err_cbc;
 	cbc_lifecycle_fd = open_cbc_device(cbc_lifecycle_dev);
 	if (cbc_lifecycle_fd < 0)
 		goto err_cbc;
+	rtc_load();
+	rtc_timer_fired();	// due while the service was not running
 	/* the handle_* function may reply on a close fd, since the client
 	 * can close the client_fd and ignore the ack */
 	signal(SIGPIPE, SIG_IGN);
-	/* if the service is to be killed by SIGTERM, we want cbc send
-	 * heartbeat suppress */
-	signal(SIGTERM, sigterm_suppress);
+	/* SIGUSR1 dumps the trace; if the service is to be killed by
+	 * SIGTERM, we want cbc send heartbeat suppress. Both are read from
+	 * a signalfd by the event loop.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 	cbcd_fd = mngr_open_un(cbcd_name, MNGR_SERVER);
 	if (cbcd_fd < 0) {
 		fprintf(stderr, "cannot open %s socket\n", cbcd_name);
@@ -708,15 +1859,14 @@ int main(void)
 		}
 		mngr_add_handler(v_fd, ACRND_STOP, handle_stop, NULL);
 	}
-	cbc_thread_create(&wakeup_reason_thread_ptr, cbc_wakeup_reason_thread,
-			NULL);  // thread to handle wakeup_reason Rx data
-
 	mngr_add_handler(cbcd_fd, WAKEUP_REASON, handle_wakeup_reason, NULL);
 	mngr_add_handler(cbcd_fd, RTC_TIMER, handle_rtc, NULL);
 	mngr_add_handler(cbcd_fd, SHUTDOWN, handle_shutdown, NULL);
 	mngr_add_handler(cbcd_fd, SUSPEND, handle_suspend, NULL);
 	mngr_add_handler(cbcd_fd, REBOOT, handle_reboot, NULL);
-	cbc_heartbeat_loop();
+	mngr_add_handler(cbcd_fd, LCS_TRACE_DUMP, handle_trace_dump, NULL);
+	cbc_rt_setup();
+	cbc_event_loop();
 	// shouldn't be here
 	mngr_close(cbcd_fd);
 	if (!is_acrn)
@@ -0,0 +1,993 @@
+/*
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * SPDX-License-identifier: BSD-3-Clause
+ */
+
+/*
+ * Life cycle simulator. A pty stands in for /dev/cbc-lifecycle: the
+ * simulated IOC sends scripted wakeup reasons and records the
+ * heartbeats. A stand-in acrnd serves the "acrnd" socket with
+ * configurable delays and refusals, and stubs of systemctl, shutdown
+ * and reboot found first in the PATH of cbc_lifecycle report to the
+ * simulator instead of taking the system down. A suspend is emulated
+ * by writing "pre" and "post" to the sleep FIFO, as the system-sleep
+ * hook does.
+ *
+ * At the end the latency of each phase seen from the IOC and acrnd
+ * side, the heartbeat jitter and the phase histograms of the
+ * cbc_lifecycle trace are reported. The storm scenario drives random
+ * wakeup reasons and acrnd decisions and checks invariants instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <acrn/acrn_mngr.h>
+
+#define pr_log(fmt, ...) fprintf(stderr, "[CBC LC Sim] " fmt, ## __VA_ARGS__)
+#define ASSERT(cond, fmt, ...) do {\
+		if (!(cond)) { \
+			pr_log("ASSERT " fmt "\n", ## __VA_ARGS__); \
+			exit(1); \
+		} \
+        } while(0)
+
+#define SIM_PATH_MAX 256
+#define SIM_TICK_US 2000		/* select timeout of the main loop */
+#define SIM_REASON_MS 500		/* the IOC repeats the wakeup reason */
+#define SIM_HEARTBEAT_MS 1000
+#define SIM_JITTER_MAX_MS 250		/* storm: keep alive heartbeat gap tolerance */
+#define SIM_SETTLE_MS 3000		/* keep alive before the next ignition off */
+#define SIM_STUCK_MS 5000		/* no progress, the scenario fails */
+#define SIM_QUIET_MS 100		/* a heartbeat this close to a stimulus may answer it */
+#define SIM_SCHED_MAX 16
+#define SIM_LCS_TRACE_DUMP 0x5f0	/* LCS_TRACE_DUMP of cbc_lifecycle */
+#define SIM_TRACE_RING 1024		/* TRACE_RING of cbc_lifecycle */
+
+/* wakeup reasons */
+#define WR_ALIVE 0x000001		/* ignition on */
+#define WR_OFF (1 << 23)		/* ignition off, shutdown requested */
+
+/* heartbeat frames {0x02, a, b, 0}, as a | b << 8 */
+#define HB_ACTIVE 0x0001
+#define HB_DELAY 0x0002
+#define HB_INIT 0x0003
+#define HB_SHUTDOWN 0x0100
+#define HB_REBOOT 0x0200
+#define HB_S3 0x0700
+
+typedef enum {
+	SC_OFF,
+	SC_REBOOT,
+	SC_REFUSE,
+	SC_S3,
+	SC_RTC,
+	SC_STORM,
+} scenario_t;
+
+static const char *scenario_name[] = { "off", "reboot", "refuse", "s3", "rtc", "storm" };
+
+/* a cycle: keep alive -> ignition off -> acrnd decision -> IOC off -> resume */
+typedef enum {
+	ST_BOOT,
+	ST_ALIVE,
+	ST_OFF,
+	ST_DECIDED,
+	ST_IOC_OFF,
+	ST_SUSPENDED,
+	ST_RESUMING,
+	ST_DONE,
+} sim_state_t;
+
+typedef enum {
+	PH_OFF_HB,		/* ignition off -> shutdown delay heartbeat */
+	PH_STOP,		/* ignition off -> ACRND_STOP at acrnd */
+	PH_DECISION_HB,		/* acrnd decision -> shutdown/reboot/s3 heartbeat */
+	PH_EXEC,		/* IOC off -> systemctl suspend, shutdown or reboot run */
+	PH_ALIVE_HB,		/* resume or refusal -> keep alive heartbeat */
+	PH_ALIVE_REQ,		/* resume or refusal -> ACRND_RESUME at acrnd */
+	PH_MAX,
+} sim_phase_t;
+
+static const char *sim_phase_name[] = {
+	"off_heartbeat", "acrnd_stop", "decision_heartbeat", "exec", "alive_heartbeat",
+	"acrnd_resume",
+};
+
+struct sim_stat {
+	unsigned long count;
+	double sum, min, max;
+};
+
+typedef enum {
+	ACT_OFF,
+	ACT_DECIDE,
+	ACT_RESUME,
+	ACT_STORM,
+	ACT_END,
+} sim_action_t;
+
+struct sim_sched {
+	double t;
+	sim_action_t action;
+};
+
+/* written by the acrnd handlers, read by the main loop */
+struct sim_acrnd_event {
+	unsigned int msgid;
+	double t;
+};
+
+static scenario_t sim_scenario;
+static int sim_cycles = 1;
+static int sim_ack_ms = 10;
+static int sim_decide_ms = 100;
+static int sim_suspend_ms = 2000;
+static int sim_storm_s = 30;
+static int sim_verbose;
+static char sim_dir[SIM_PATH_MAX];
+
+static sim_state_t sim_st = ST_BOOT;
+static int sim_fd = -1;			/* pty master, the IOC side */
+static int sim_acrnd_pipe[2];
+static int sim_suspended;
+static unsigned int sim_reason = WR_ALIVE;
+static double sim_reason_ts;
+static double sim_t_off, sim_t_decide, sim_t_ioc_off, sim_t_alive;
+static int sim_off_hb, sim_alive_hb, sim_alive_req;
+static int sim_cycles_done;
+static double sim_progress_ts;
+static int sim_rtc_delta = -1, sim_rtc_unit;
+static double sim_rtc_ts;
+static time_t sim_rtc_first;
+
+static struct sim_stat sim_stats[PH_MAX];
+static struct sim_stat sim_jitter;	/* keep alive heartbeat period, ms */
+static double sim_hb_ts, sim_event_ts;
+static unsigned int sim_hb_kind;
+
+static struct sim_sched sim_sched[SIM_SCHED_MAX];
+static int sim_sched_num;
+
+/* storm */
+static int sim_storm_over;
+static unsigned long sim_stimuli, sim_suspends, sim_violations;
+static double sim_gap_max;
+
+static double sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void sim_stat_add(struct sim_stat *s, double v)
+{
+	if (!s->count || v < s->min)
+		s->min = v;
+	if (v > s->max)
+		s->max = v;
+	s->sum += v;
+	s->count++;
+}
+
+static void sim_phase(sim_phase_t ph, double start, double end)
+{
+	if (start <= 0)
+		return;
+	sim_stat_add(&sim_stats[ph], end - start);
+	if (sim_verbose)
+		pr_log("%s %.1f ms\n", sim_phase_name[ph], end - start);
+}
+
+static void sim_violation(const char *fmt, ...)
+{
+	va_list ap;
+
+	sim_violations++;
+	pr_log("INVARIANT ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+static void sim_schedule(sim_action_t action, double t)
+{
+	ASSERT(sim_sched_num < SIM_SCHED_MAX, "too many scheduled actions");
+	sim_sched[sim_sched_num].t = t;
+	sim_sched[sim_sched_num].action = action;
+	sim_sched_num++;
+}
+
+static int sim_pty(char *name, size_t size)
+{
+	struct termios tio;
+	int fd, slave;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	ASSERT(fd >= 0 && grantpt(fd) == 0 && unlockpt(fd) == 0, "posix_openpt error");
+	snprintf(name, size, "%s", ptsname(fd));
+	/* keep the slave open and raw, frames must pass unchanged */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	ASSERT(slave >= 0 && tcgetattr(slave, &tio) == 0, "open %s error", name);
+	cfmakeraw(&tio);
+	ASSERT(tcsetattr(slave, TCSANOW, &tio) == 0, "tcsetattr %s error", name);
+	return fd;
+}
+
+static void sim_write(int fd, const void *buf, int len)
+{
+	int ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		ASSERT(ret > 0, "write error %d", errno);
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+}
+
+/* the IOC wakeup reason frame, sent at once on a change */
+static void sim_ioc_reason(unsigned int reason)
+{
+	unsigned char frame[4] = { 0x01, reason & 0xff, (reason >> 8) & 0xff, (reason >> 16) & 0xff };
+
+	sim_reason_ts = sim_now();
+	/* the periodic repeat changes nothing */
+	if (reason != sim_reason)
+		sim_event_ts = sim_reason_ts;
+	sim_reason = reason;
+	sim_write(sim_fd, frame, sizeof(frame));
+}
+
+/* what the system-sleep hook writes */
+static void sim_sleep_hook(const char *phase)
+{
+	char path[SIM_PATH_MAX + 32];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/cbc_lifecycle.sleep", sim_dir);
+	fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		pr_log("open %s error %d\n", path, errno);
+		return;
+	}
+	sim_event_ts = sim_now();
+	dprintf(fd, "%s\n", phase);
+	close(fd);
+}
+
+/* stand-in acrnd: ack after the configured delay, the main loop acts on it */
+static void sim_acrnd_handler(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct sim_acrnd_event ev = { msg->msgid, sim_now() };
+	struct mngr_msg ack;
+
+	if (write(sim_acrnd_pipe[1], &ev, sizeof(ev)) < 0)
+		pr_log("acrnd pipe error %d\n", errno);
+	usleep(sim_ack_ms * 1000);
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+	ack.data.err = 0;
+	mngr_send_msg(client_fd, &ack, NULL, 0);
+}
+
+/* request of acrnd to cbc_lifecycle, on the sos-lcs socket */
+static void sim_acrnd_send(struct mngr_msg *req)
+{
+	int fd = mngr_open_un("sos-lcs", MNGR_CLIENT);
+
+	if (fd < 0) {
+		pr_log("cannot open sos-lcs socket\n");
+		return;
+	}
+	req->magic = MNGR_MSG_MAGIC;
+	req->timestamp = time(NULL);
+	mngr_send_msg(fd, req, NULL, 0);
+	mngr_close(fd);
+}
+
+static void sim_acrnd_decide(unsigned int msgid, int err)
+{
+	struct mngr_msg req = { .msgid = msgid };
+
+	req.data.err = err;
+	sim_event_ts = sim_now();
+	sim_acrnd_send(&req);
+}
+
+static void sim_acrnd_rtc(const char *vmname, time_t t)
+{
+	struct mngr_msg req = { .msgid = RTC_TIMER };
+
+	snprintf(req.data.rtc_timer.vmname, sizeof(req.data.rtc_timer.vmname), "%s", vmname);
+	req.data.rtc_timer.t = t;
+	sim_acrnd_send(&req);
+}
+
+/* pending timers in the cbc_lifecycle store, -1 if it cannot be read */
+static int sim_rtc_pending(void)
+{
+	char path[SIM_PATH_MAX + 32], line[128];
+	FILE *file;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "%s/rtc_timers", sim_dir);
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+	while (fgets(line, sizeof(line), file))
+		n++;
+	fclose(file);
+	return n;
+}
+
+/* a cycle reached keep alive again */
+static void sim_alive(double t)
+{
+	if (!sim_alive_hb || !sim_alive_req)
+		return;
+	if (sim_scenario == SC_RTC && sim_st == ST_RESUMING)
+		printf("rtc: %d timer(s) still pending after the resume\n", sim_rtc_pending());
+	if (sim_st != ST_BOOT)
+		sim_cycles_done++;
+	if (sim_cycles_done >= sim_cycles) {
+		sim_st = ST_DONE;
+		return;
+	}
+	sim_st = ST_ALIVE;
+	sim_schedule(ACT_OFF, t + SIM_SETTLE_MS);
+}
+
+static void sim_on_heartbeat(unsigned int kind, double t)
+{
+	if (kind != HB_ACTIVE && kind != HB_DELAY && kind != HB_INIT && kind != HB_SHUTDOWN &&
+	    kind != HB_REBOOT && kind != HB_S3)
+		sim_violation("unknown heartbeat 0x%04x", kind);
+	/* the period of two keep alive heartbeats without a stimulus in between */
+	if (kind == HB_ACTIVE && sim_hb_kind == HB_ACTIVE && sim_hb_ts - SIM_QUIET_MS > sim_event_ts) {
+		sim_stat_add(&sim_jitter, t - sim_hb_ts);
+		if (t - sim_hb_ts > sim_gap_max)
+			sim_gap_max = t - sim_hb_ts;
+		if (sim_scenario == SC_STORM && t - sim_hb_ts > SIM_HEARTBEAT_MS + SIM_JITTER_MAX_MS)
+			sim_violation("keep alive heartbeat gap %.1f ms", t - sim_hb_ts);
+	}
+	sim_hb_ts = t;
+	sim_hb_kind = kind;
+	if (sim_verbose)
+		pr_log("heartbeat 0x%04x\n", kind);
+	if (sim_scenario == SC_STORM) {
+		/* the IOC powers the SoC off once told to */
+		if (kind == HB_S3 && sim_reason && !sim_suspended)
+			sim_ioc_reason(0);
+		else if (kind == HB_ACTIVE && sim_storm_over)
+			sim_st = ST_DONE;
+		return;
+	}
+
+	switch (sim_st) {
+	case ST_BOOT:
+	case ST_RESUMING:
+		if (kind == HB_ACTIVE && !sim_alive_hb) {
+			sim_phase(PH_ALIVE_HB, sim_t_alive, t);
+			sim_alive_hb = 1;
+			sim_progress_ts = t;
+			sim_alive(t);
+		}
+		break;
+	case ST_OFF:
+		if (kind == HB_DELAY && !sim_off_hb) {
+			sim_phase(PH_OFF_HB, sim_t_off, t);
+			sim_off_hb = 1;
+			sim_progress_ts = t;
+		}
+		break;
+	case ST_DECIDED:
+		if (kind == HB_SHUTDOWN || kind == HB_REBOOT || kind == HB_S3) {
+			sim_phase(PH_DECISION_HB, sim_t_decide, t);
+			/* the IOC powers the SoC off */
+			sim_st = ST_IOC_OFF;
+			sim_t_ioc_off = t;
+			sim_progress_ts = t;
+			sim_ioc_reason(0);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void sim_on_rtc(int delta, int unit, double t)
+{
+	static const int unit_s[] = { 1, 60, 3600, 86400, 604800 };
+
+	if (unit > 4) {
+		sim_violation("rtc frame with unit %d", unit);
+		return;
+	}
+	sim_rtc_delta = delta * unit_s[unit];
+	sim_rtc_unit = unit;
+	sim_rtc_ts = t;
+	if (sim_scenario == SC_RTC)
+		printf("rtc: IOC wakeup in %d s (unit %d), earliest request in %ld s\n",
+			sim_rtc_delta, unit, (long)(sim_rtc_first - time(NULL)));
+}
+
+static void sim_on_acrnd(const struct sim_acrnd_event *ev)
+{
+	if (sim_verbose)
+		pr_log("acrnd request 0x%x\n", ev->msgid);
+	if (sim_scenario == SC_STORM) {
+		/* acrnd always answers a stop request, sooner or later */
+		if (ev->msgid == ACRND_STOP)
+			sim_schedule(ACT_DECIDE, ev->t + rand() % (2 * sim_decide_ms + 1));
+		return;
+	}
+	if (ev->msgid == ACRND_STOP && sim_st == ST_OFF) {
+		sim_phase(PH_STOP, sim_t_off, ev->t);
+		sim_progress_ts = ev->t;
+		sim_schedule(ACT_DECIDE, ev->t + sim_decide_ms);
+	} else if (ev->msgid == ACRND_RESUME && (sim_st == ST_BOOT || sim_st == ST_RESUMING) &&
+		   !sim_alive_req) {
+		sim_phase(PH_ALIVE_REQ, sim_t_alive, ev->t);
+		sim_alive_req = 1;
+		sim_progress_ts = ev->t;
+		sim_alive(ev->t);
+	}
+}
+
+static void sim_on_exec(const char *cmd, double t)
+{
+	if (sim_verbose)
+		pr_log("exec %s\n", cmd);
+	if (!strncmp(cmd, "systemctl list-jobs", 19))
+		return;
+	if (!strncmp(cmd, "systemctl suspend", 17)) {
+		sim_sleep_hook("pre");
+		sim_suspended = 1;
+		sim_suspends++;
+		if (sim_scenario == SC_STORM) {
+			sim_schedule(ACT_RESUME, t + rand() % 200);
+			return;
+		}
+		sim_phase(PH_EXEC, sim_t_ioc_off, t);
+		sim_st = ST_SUSPENDED;
+		sim_progress_ts = t;
+		/* with a timer, the IOC wakes the SoC when it expires */
+		if (sim_scenario == SC_RTC && sim_rtc_delta >= 0)
+			sim_schedule(ACT_RESUME, sim_rtc_ts + sim_rtc_delta * 1000.0);
+		else
+			sim_schedule(ACT_RESUME, t + sim_suspend_ms);
+		return;
+	}
+	if (!strncmp(cmd, "shutdown", 8) || !strncmp(cmd, "reboot", 6)) {
+		if (sim_scenario == SC_STORM || sim_st != ST_IOC_OFF) {
+			sim_violation("unexpected %s", cmd);
+			return;
+		}
+		sim_phase(PH_EXEC, sim_t_ioc_off, t);
+		sim_cycles_done++;
+		sim_st = ST_DONE;
+		return;
+	}
+	pr_log("unknown command %s\n", cmd);
+}
+
+/* storm: one random stimulus, shutdown and reboot are never decided */
+static void sim_storm_step(double t)
+{
+	int r = rand() % 16;
+
+	if (sim_storm_over)
+		return;
+	sim_stimuli++;
+	if (sim_suspended) {
+		/* the IOC is quiet while the SoC sleeps */
+	} else if (r < 5) {
+		sim_ioc_reason(WR_ALIVE);
+	} else if (r < 8) {
+		sim_ioc_reason(WR_OFF);
+	} else if (r < 9) {
+		sim_ioc_reason(0);
+	} else if (r < 12) {
+		sim_acrnd_decide(SUSPEND, 0);
+	} else if (r < 15) {
+		sim_acrnd_decide(rand() % 2 ? SHUTDOWN : REBOOT, -1);
+	} else {
+		char name[16];
+
+		snprintf(name, sizeof(name), "vm%d", rand() % 4);
+		sim_acrnd_rtc(name, time(NULL) + 1 + rand() % 600);
+	}
+	/* bursts, with quiet periods to measure the heartbeat period */
+	if (rand() % 20)
+		sim_schedule(ACT_STORM, t + rand() % 50);
+	else
+		sim_schedule(ACT_STORM, t + SIM_HEARTBEAT_MS + rand() % 2000);
+}
+
+static void sim_action(sim_action_t action, double t)
+{
+	time_t now;
+
+	switch (action) {
+	case ACT_OFF:
+		sim_st = ST_OFF;
+		sim_t_off = t;
+		sim_off_hb = 0;
+		sim_progress_ts = t;
+		sim_ioc_reason(WR_OFF);
+		break;
+	case ACT_DECIDE:
+		if (sim_scenario == SC_STORM) {
+			if (rand() % 2)
+				sim_acrnd_decide(SUSPEND, 0);
+			else
+				sim_acrnd_decide(SHUTDOWN, -1);
+			break;
+		}
+		sim_st = ST_DECIDED;
+		sim_t_decide = t;
+		sim_progress_ts = t;
+		switch (sim_scenario) {
+		case SC_OFF:
+			sim_acrnd_decide(SHUTDOWN, 0);
+			break;
+		case SC_REBOOT:
+			sim_acrnd_decide(REBOOT, 0);
+			break;
+		case SC_REFUSE:
+			/* acrnd refuses, the driver turns the key on again */
+			sim_acrnd_decide(SHUTDOWN, -1);
+			sim_st = ST_RESUMING;
+			sim_alive_hb = sim_alive_req = 0;
+			sim_t_alive = t;
+			sim_ioc_reason(WR_ALIVE);
+			break;
+		case SC_RTC:
+			/* two timers close enough to share a wakeup, one far */
+			now = time(NULL);
+			sim_rtc_first = now + 3;
+			sim_acrnd_rtc("vm1", now + 3);
+			sim_acrnd_rtc("vm2", now + 30);
+			sim_acrnd_rtc("vm3", now + 3600);
+			sim_acrnd_decide(SUSPEND, 0);
+			break;
+		default:
+			sim_acrnd_decide(SUSPEND, 0);
+			break;
+		}
+		break;
+	case ACT_RESUME:
+		sim_suspended = 0;
+		sim_sleep_hook("post");
+		if (sim_scenario == SC_STORM) {
+			sim_ioc_reason(WR_ALIVE);
+			break;
+		}
+		sim_st = ST_RESUMING;
+		sim_alive_hb = sim_alive_req = 0;
+		sim_t_alive = t;
+		sim_progress_ts = t;
+		sim_ioc_reason(WR_ALIVE);
+		break;
+	case ACT_STORM:
+		sim_storm_step(t);
+		break;
+	case ACT_END:
+		sim_st = ST_DONE;
+		break;
+	}
+}
+
+static void sim_run_sched(double t)
+{
+	int i;
+
+	for (i = 0; i < sim_sched_num; i++) {
+		if (sim_sched[i].t > t)
+			continue;
+		sim_action_t action = sim_sched[i].action;
+
+		sim_sched[i] = sim_sched[--sim_sched_num];
+		sim_action(action, t);
+		i = -1;		// the action may have changed the table
+	}
+}
+
+/* heartbeat, suppress and rtc frames, 4 bytes each */
+static void sim_read_ioc(int fd)
+{
+	static unsigned char frame[4];
+	static int have;
+	unsigned char buf[256];
+	double t = sim_now();
+	int i, len;
+
+	len = read(fd, buf, sizeof(buf));
+	for (i = 0; i < len; i++) {
+		frame[have++] = buf[i];
+		if (have < 4)
+			continue;
+		have = 0;
+		if (frame[0] == 0x02)
+			sim_on_heartbeat(frame[1] | frame[2] << 8, t);
+		else if (frame[0] == 0x05)
+			sim_on_rtc(frame[1] | frame[2] << 8, frame[3], t);
+		else if (frame[0] != 0x04)
+			sim_violation("unknown frame type 0x%02x", frame[0]);
+	}
+}
+
+/* commands written by the PATH stubs, one per line */
+static void sim_read_exec(int fd)
+{
+	static char line[256];
+	static int have;
+	char buf[256];
+	int i, len;
+
+	len = read(fd, buf, sizeof(buf));
+	for (i = 0; i < len; i++) {
+		if (buf[i] != '\n') {
+			if (have < (int)sizeof(line) - 1)
+				line[have++] = buf[i];
+			continue;
+		}
+		line[have] = 0;
+		have = 0;
+		sim_on_exec(line, sim_now());
+	}
+}
+
+/* systemctl, shutdown and reboot of cbc_lifecycle end up here */
+static int sim_stubs(void)
+{
+	static const char *cmds[] = { "systemctl", "shutdown", "reboot" };
+	char path[SIM_PATH_MAX + 32];
+	unsigned int i;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/bin", sim_dir);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+	snprintf(path, sizeof(path), "%s/exec", sim_dir);
+	if (mkfifo(path, 0600) < 0 && errno != EEXIST)
+		return -1;
+	for (i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+		snprintf(path, sizeof(path), "%s/bin/%s", sim_dir, cmds[i]);
+		file = fopen(path, "w");
+		if (!file)
+			return -1;
+		fprintf(file, "#!/bin/sh\necho \"%s $*\" 1<> %s/exec\n", cmds[i], sim_dir);
+		fclose(file);
+		chmod(path, 0755);
+	}
+	snprintf(path, sizeof(path), "%s/exec", sim_dir);
+	return open(path, O_RDWR | O_NONBLOCK);
+}
+
+struct sim_transit {
+	unsigned int seq;
+	char from[32], to[32];
+};
+
+static int sim_transit_cmp(const void *a, const void *b)
+{
+	unsigned int x = ((const struct sim_transit *)a)->seq;
+	unsigned int y = ((const struct sim_transit *)b)->seq;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the phase histograms, check the transitions of the trace. The
+ * trace is requested on the socket, the event loop of cbc_lifecycle is
+ * blocked once it ran shutdown or reboot.
+ */
+static void sim_trace_check(void)
+{
+	static struct sim_transit tr[SIM_TRACE_RING];
+	char path[SIM_PATH_MAX + 32], line[256];
+	struct mngr_msg req = { .magic = MNGR_MSG_MAGIC, .msgid = SIM_LCS_TRACE_DUMP }, ack;
+	unsigned int transits = 0, lines = 0, i;
+	FILE *file;
+	int fd, events = 0;
+
+	snprintf(path, sizeof(path), "%s/cbc_lifecycle.trace", sim_dir);
+	unlink(path);
+	fd = mngr_open_un("sos-lcs", MNGR_CLIENT);
+	if (fd < 0)
+		return;
+	req.timestamp = time(NULL);
+	ack.data.err = -1;
+	mngr_send_msg(fd, &req, &ack, 2);
+	mngr_close(fd);
+	file = ack.data.err ? NULL : fopen(path, "r");
+	if (!file) {
+		pr_log("no trace from cbc_lifecycle\n");
+		return;
+	}
+	if (sim_scenario != SC_STORM)
+		printf("cbc_lifecycle trace:\n");
+	while (fgets(line, sizeof(line), file)) {
+		if (!strncmp(line, "# seconds", 9)) {
+			events = 1;
+			continue;
+		}
+		if (!events) {
+			if (sim_scenario != SC_STORM)
+				printf("  %s", line);
+			continue;
+		}
+		lines++;
+		if (transits < SIM_TRACE_RING && sscanf(line, "%*s transit %31s %31s %u",
+				tr[transits].from, tr[transits].to, &tr[transits].seq) == 3)
+			transits++;
+	}
+	fclose(file);
+	/*
+	 * The hooks of concurrent transitions are traced in any order, the
+	 * sequence number of the compare and swap orders them: each one
+	 * starts where the one before ended. Numbers are missing only when
+	 * the ring dropped the oldest events.
+	 */
+	qsort(tr, transits, sizeof(tr[0]), sim_transit_cmp);
+	for (i = 0; i < transits; i++) {
+		if (!strcmp(tr[i].from, tr[i].to))
+			sim_violation("transition %u from %s to itself", tr[i].seq, tr[i].from);
+		if (!i)
+			continue;
+		if (tr[i].seq == tr[i - 1].seq)
+			sim_violation("transition %u traced twice", tr[i].seq);
+		else if (tr[i].seq != tr[i - 1].seq + 1 && lines < SIM_TRACE_RING)
+			sim_violation("transition %u missing", tr[i - 1].seq + 1);
+		else if (tr[i].seq == tr[i - 1].seq + 1 && strcmp(tr[i].from, tr[i - 1].to))
+			sim_violation("transition %u from %s after one to %s", tr[i].seq,
+				tr[i].from, tr[i - 1].to);
+	}
+	if (sim_scenario == SC_STORM)
+		printf("transitions: %u in the trace\n", transits);
+}
+
+static void sim_report(void)
+{
+	int i;
+
+	if (sim_scenario == SC_STORM) {
+		printf("storm: %d s, %lu stimuli, %lu suspends\n", sim_storm_s, sim_stimuli, sim_suspends);
+	} else {
+		printf("%s: %d of %d cycle(s)\n", scenario_name[sim_scenario], sim_cycles_done,
+			sim_cycles);
+		printf("# phase count min_ms mean_ms max_ms\n");
+		for (i = 0; i < PH_MAX; i++) {
+			struct sim_stat *s = &sim_stats[i];
+
+			printf("%s %lu %.1f %.1f %.1f\n", sim_phase_name[i], s->count, s->min,
+				s->count ? s->sum / s->count : 0.0, s->max);
+		}
+	}
+	if (sim_jitter.count)
+		printf("heartbeat period: %lu, min %.1f mean %.1f max %.1f ms\n", sim_jitter.count,
+			sim_jitter.min, sim_jitter.sum / sim_jitter.count, sim_jitter.max);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options] <scenario> [-- <cbc_lifecycle command>]\n"
+		"Scenarios:\n"
+		"  off     ignition off, acrnd agrees to shut down\n"
+		"  reboot  ignition off, acrnd decides to reboot\n"
+		"  refuse  ignition off, acrnd refuses and the key is turned on again\n"
+		"  s3      ignition off, suspend and resume\n"
+		"  rtc     like s3, with RTC timers of three VMs\n"
+		"  storm   random wakeup reasons and acrnd decisions, invariants checked\n"
+		"Options:\n"
+		"  -n  cycles of refuse, s3 and rtc, default 1\n"
+		"  -A  acrnd ack delay in ms, default 10\n"
+		"  -D  acrnd decision delay in ms, default 100\n"
+		"  -S  suspend duration in ms, default 2000\n"
+		"  -T  storm duration in s, default 30\n"
+		"  -r  state directory, default a new /tmp/cbc_lifecycle_sim.XXXXXX\n"
+		"  -s  random seed of the storm\n"
+		"  -v  log every event\n"
+		"The cbc_lifecycle command is started with \"-a -d <pty> -r <state directory>\"\n"
+		"appended and the stubs first in its PATH. Without it, the pty and the\n"
+		"directory are printed and cbc_lifecycle is expected to be started by hand.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	char pty_name[64], path[SIM_PATH_MAX + 32];
+	struct sim_acrnd_event ev;
+	unsigned int seed = time(NULL);
+	int c, i, exec_fd, acrnd_fd, max_fd, ret;
+	double t, end = 0;
+	pid_t child = -1;
+	struct timeval tv;
+	fd_set rfd;
+
+	while ((c = getopt(argc, argv, "n:A:D:S:T:r:s:vh")) != -1) {
+		switch (c) {
+		case 'n':
+			sim_cycles = atoi(optarg);
+			break;
+		case 'A':
+			sim_ack_ms = atoi(optarg);
+			break;
+		case 'D':
+			sim_decide_ms = atoi(optarg);
+			break;
+		case 'S':
+			sim_suspend_ms = atoi(optarg);
+			break;
+		case 'T':
+			sim_storm_s = atoi(optarg);
+			break;
+		case 'r':
+			snprintf(sim_dir, sizeof(sim_dir), "%s", optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			sim_verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (optind >= argc || sim_cycles < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = 0; i <= SC_STORM; i++)
+		if (!strcmp(argv[optind], scenario_name[i]))
+			break;
+	if (i > SC_STORM) {
+		usage(argv[0]);
+		return 1;
+	}
+	sim_scenario = i;
+	srand(seed);
+
+	if (!sim_dir[0]) {
+		snprintf(sim_dir, sizeof(sim_dir), "/tmp/cbc_lifecycle_sim.XXXXXX");
+		ASSERT(mkdtemp(sim_dir), "mkdtemp error %d", errno);
+	} else {
+		ASSERT(mkdir(sim_dir, 0755) == 0 || errno == EEXIST, "mkdir %s error", sim_dir);
+	}
+	exec_fd = sim_stubs();
+	ASSERT(exec_fd >= 0, "cannot create the stubs in %s", sim_dir);
+	ASSERT(pipe(sim_acrnd_pipe) == 0, "pipe error");
+	acrnd_fd = mngr_open_un("acrnd", MNGR_SERVER);
+	ASSERT(acrnd_fd >= 0, "cannot open the acrnd socket, is acrnd running?");
+	mngr_add_handler(acrnd_fd, ACRND_STOP, sim_acrnd_handler, NULL);
+	mngr_add_handler(acrnd_fd, ACRND_RESUME, sim_acrnd_handler, NULL);
+	sim_fd = sim_pty(pty_name, sizeof(pty_name));
+	signal(SIGPIPE, SIG_IGN);
+
+	if (optind + 1 < argc) {
+		char **cmd = calloc(argc - optind + 6, sizeof(*cmd));
+
+		ASSERT(cmd, "out of memory");
+		for (i = optind + 1; i < argc; i++)
+			cmd[i - optind - 1] = argv[i];
+		i = argc - optind - 1;
+		cmd[i++] = "-a";
+		cmd[i++] = "-d";
+		cmd[i++] = pty_name;
+		cmd[i++] = "-r";
+		cmd[i++] = sim_dir;
+		child = fork();
+		ASSERT(child >= 0, "fork error");
+		if (child == 0) {
+			/* no cbc_lifecycle left behind on the pty */
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			snprintf(path, sizeof(path), "%s/bin:%s", sim_dir, getenv("PATH") ? : "/usr/bin:/bin");
+			setenv("PATH", path, 1);
+			execvp(cmd[0], cmd);
+			pr_log("exec %s error %d\n", cmd[0], errno);
+			_exit(127);
+		}
+	} else {
+		printf("device pty: %s\nstate directory: %s\n"
+			"run: PATH=%s/bin:$PATH cbc_lifecycle -a -d %s -r %s\n",
+			pty_name, sim_dir, sim_dir, pty_name, sim_dir);
+		fflush(stdout);
+	}
+
+	pr_log("%s scenario, state in %s\n", scenario_name[sim_scenario], sim_dir);
+	sim_t_alive = sim_progress_ts = sim_now();
+	sim_ioc_reason(WR_ALIVE);
+	if (sim_scenario == SC_STORM) {
+		pr_log("storm seed %u\n", seed);
+		end = sim_now() + sim_storm_s * 1000.0;
+		sim_schedule(ACT_STORM, sim_now() + SIM_SETTLE_MS);
+	}
+	max_fd = sim_fd;
+	if (exec_fd > max_fd)
+		max_fd = exec_fd;
+	if (sim_acrnd_pipe[0] > max_fd)
+		max_fd = sim_acrnd_pipe[0];
+
+	while (sim_st != ST_DONE) {
+		t = sim_now();
+		sim_run_sched(t);
+		if (sim_scenario == SC_STORM && t >= end) {
+			if (sim_storm_over) {
+				sim_violation("no keep alive after the storm");
+				break;
+			}
+			/* the machine must come back to keep alive once the storm is over */
+			sim_storm_over = 1;
+			end = t + SIM_STUCK_MS;
+			if (!sim_suspended)
+				sim_ioc_reason(WR_ALIVE);
+		}
+		/* cbc_lifecycle waits for the resume, a suspend may be long */
+		if (sim_scenario != SC_STORM && sim_st != ST_SUSPENDED && sim_st != ST_ALIVE &&
+		    t - sim_progress_ts > SIM_STUCK_MS + sim_decide_ms + sim_ack_ms) {
+			pr_log("no progress in state %d\n", sim_st);
+			sim_violations++;
+			break;
+		}
+		if (!sim_suspended && t - sim_reason_ts >= SIM_REASON_MS)
+			sim_ioc_reason(sim_reason);
+		if (child > 0 && waitpid(child, &ret, WNOHANG) == child) {
+			pr_log("cbc_lifecycle exited\n");
+			child = -1;
+			sim_violations++;
+			break;
+		}
+
+		FD_ZERO(&rfd);
+		FD_SET(sim_fd, &rfd);
+		FD_SET(exec_fd, &rfd);
+		FD_SET(sim_acrnd_pipe[0], &rfd);
+		tv.tv_sec = 0;
+		tv.tv_usec = SIM_TICK_US;
+		if (select(max_fd + 1, &rfd, NULL, NULL, &tv) <= 0)
+			continue;
+		if (FD_ISSET(sim_fd, &rfd))
+			sim_read_ioc(sim_fd);
+		if (FD_ISSET(exec_fd, &rfd))
+			sim_read_exec(exec_fd);
+		if (FD_ISSET(sim_acrnd_pipe[0], &rfd) &&
+		    read(sim_acrnd_pipe[0], &ev, sizeof(ev)) == sizeof(ev))
+			sim_on_acrnd(&ev);
+	}
+
+	sim_report();
+	sim_trace_check();
+	if (sim_scenario == SC_STORM || sim_violations)
+		printf("violations: %lu\n", sim_violations);
+
+	if (child > 0) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+	}
+	mngr_close(acrnd_fd);
+	return sim_violations ? 1 : 0;
+}
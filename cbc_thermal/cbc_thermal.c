@@ -6,9 +6,9 @@
  * SPDX-License-identifier: BSD-3-Clause
  */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 28
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -20,7 +20,15 @@
 #include <pthread.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "cbc_thermal.h"
+#include "cbc_thermal_shm.h"
 
 //#define DEBUG
 #define pr_log(fmt, ...) do { \
@@ -57,22 +65,317 @@
 #endif
 
 #define TH_IO_DIR "/run/cbc_thermal"
+#define TH_SIGNALS_DEV "/dev/cbc-signals"
+#define TH_DIAGNOSIS_DEV "/dev/cbc-diagnosis"
 #define TH_IOBUF_MAX 64
+#define TH_IO_MAX 1024
+#define TH_CONF_FILE "/etc/ioc-cbc-tools/cbc_thermal.conf"
+#define TH_CONF_DEFAULT_FILE "/usr/share/ioc-cbc-tools/cbc_thermal.conf"
+#define TH_NAME_MAX 64
+#define TH_UNIT_MAX 16
+#define TH_SIG_MAX 255
+#define TH_SIG_ID_NUM 0x10000
+/* the tree is static, let the kernel cache entries and attributes */
+#define TH_ENTRY_TIMEOUT 86400.0
+#define TH_ATTR_TIMEOUT 86400.0
+#define TH_HASH_SIZE (TH_IO_MAX * 2)
+#define TH_HISTORY_DIR "history"
+#define TH_RAW_DIR "raw"
+#define TH_FILTER_WIN_MAX 15		/* median window */
+#define TH_SPIKE_CONFIRM 3		/* samples past the spike threshold taken as a step */
+#define TH_STALE_CHECK 100		/* ms */
+#define TH_HISTORY_LEN_DEFAULT 4096
+#define TH_FAN_MIN_INTERVAL_DEFAULT 100	/* ms */
+#define TH_CDEV_MAX 8
+#define TH_CDEV_INDEX_MAX 8		/* duties in one command frame */
+#define TH_PREDICT_MAX 8
+#define TH_PREDICT_ALPHA 0.3		/* slope low pass filter */
+#define TH_THERMAL_ZONE "/sys/class/thermal/thermal_zone"
+#define TH_PATH_MAX 128
+#define TH_RAPL_DEFAULT "/sys/class/powercap/intel-rapl:0/constraint_0_power_limit_uw"
+#define TH_TRACE_DIR "/var/log/cbc_thermal"
+#define TH_TRACE_BOOT_ID "/proc/sys/kernel/random/boot_id"
+#define TH_TRACE_RING 8192		/* samples between two flushes */
+#define TH_TRACE_PARTS 8		/* a part is trace_max_kb / TH_TRACE_PARTS */
+#define TH_TRACE_FLUSH_DEFAULT 10000	/* ms */
+
+/* inode 1 is the root directory, io nodes start from 2 */
+#define IO_INO(_io) ((fuse_ino_t)((_io) - io_inits) + FUSE_ROOT_ID + 1)
+
+#define IO_FOREACH(_i, _io) for (_i = 0, _io = &io_inits[0]; _i < io_inits_num; _i++, _io++)
+#define SIG_FOREACH(_i, _sig) for (_i = 0, _sig = &cbc_th_signals[0]; _i < cbc_th_signals_num; _i++, _sig++)
+#define CDEV_FOREACH(_i, _cdev) for (_i = 0, _cdev = &cbc_th_cdevs[0]; _i < cbc_th_cdevs_num; _i++, _cdev++)
+
+struct cbc_th_fh;
 
-#define IO_FOREACH(_i, _io) for (_i = 0, _io = &io_inits[0]; _i < IO_INITS_NUM; _i++, _io++)
+struct dirbuf {
+	char *p;
+	size_t size;
+};
 
 struct cbc_th_io {
 	char *name;
+	struct cbc_th_io *parent;	/* NULL for the root directory */
+	int is_dir;
+	struct dirbuf dir;		/* directory stream, built on first readdir */
 	void *data;
 	int (*read)(char *buf, int len, void *data);
 	int (*write)(char *buf, int len, void *data);
+	/* for large files: malloc'ed content, snapshot taken on open */
+	char *(*dump)(size_t *len, void *data);
+	unsigned int gen;		/* bumped on every notified change */
+	struct cbc_th_fh *fhs;		/* open files, guarded by cbc_th_poll_lock */
+};
+
+/* per open file state, kept in fuse_file_info->fh */
+struct cbc_th_fh {
+	struct cbc_th_io *io;
+	unsigned int gen;		/* io->gen seen by the last read */
+	struct fuse_pollhandle *ph;
+	char *buf;			/* io->dump() snapshot */
+	size_t len;
+	struct cbc_th_fh *next;
+};
+
+/*
+ * IOC controlled cooling device. Duty requests are queued and sent by
+ * cbc_cdev_thread(), pending requests collapse to the latest value.
+ * The devices sharing a command id are sent in one frame
+ * {cmd, duty of index 0, duty of index 1, ...}, the IOC reports them
+ * the same way with the report id.
+ */
+struct cbc_th_cdev {
+	char name[TH_NAME_MAX];
+	unsigned char cmd;		/* diagnosis command id */
+	unsigned char report;		/* diagnosis report id */
+	int index;			/* duty position in the command and report */
+	int duty_min;			/* duty range of the device */
+	int duty_max;
+	int val;			/* duty reported by the IOC */
+	int min_val;			/* duty requested by the user, enforced as minimum */
+	int predict_val;		/* minimal duty from cbc_predict_thread() */
+	int cool_val;			/* minimal duty from the composite cooling device */
+	int pending;			/* queued duty, -1 if none */
+	int sent;			/* last duty sent, -1 if none */
+	uint64_t sent_ts;
+	struct cbc_th_io *io;
+	/* command statistics */
+	unsigned long requested;
+	unsigned long coalesced;	/* replaced by a newer request before being sent */
+	unsigned long suppressed;	/* dropped by hysteresis */
+	unsigned long sent_cnt;
+	unsigned long resent;		/* same duty sent again, IOC did not follow */
+};
+
+/*
+ * Temperature watched by cbc_predict_thread(): the temperature in
+ * horizon ms is extrapolated from the filtered slope, the fan minimal
+ * duty rises with the predicted excess over (trip - margin).
+ */
+struct cbc_th_predictor {
+	char name[TH_NAME_MAX];
+	int trip;			/* mC */
+	struct cbc_th_signal *sig;	/* CBC signal, or */
+	int fd;				/* thermal zone temp file */
+	int temp;
+	double slope;			/* mC/s */
+	int predicted;
+	int duty;
+	uint64_t ts;
+};
+
+/*
+ * Composite cooling device: states [0, fan_steps + rapl_steps], each
+ * state spends one step of the cheaper stage until it is exhausted,
+ * then steps the other one. Fan steps raise the fan minimal duty, RAPL
+ * steps lower the power limit from its original value towards
+ * rapl_min percent of it.
+ */
+struct cbc_th_cool {
+	char name[TH_NAME_MAX];
+	struct cbc_th_cdev *fan;
+	char rapl[TH_PATH_MAX];		/* power limit file, "none" to disable */
+	int rapl_fd;
+	long rapl_orig;			/* uW */
+	char rapl_orig_buf[24];		/* rapl_orig as written back on exit */
+	long rapl_val;			/* uW, last written */
+	int fan_steps;
+	int fan_cost;
+	int rapl_steps;
+	int rapl_cost;
+	int rapl_min;			/* percent of rapl_orig */
+	int state;
+	pthread_mutex_t lock;
+};
+
+struct cbc_th_trace_rec {
+	uint64_t ts;
+	int32_t val;
+	uint32_t idx;			/* shared memory index */
+};
+
+/* fixed size ring of the latest samples of one signal */
+struct cbc_th_history {
+	struct cbc_th_history_sample *samples;
+	unsigned int head;		/* next slot to write */
+	unsigned int count;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Filter of one signal, applied to every value of the IOC before it is
+ * published. A value further than spike from the filtered one is
+ * dropped unless TH_SPIKE_CONFIRM values in a row are past the threshold
+ * and within spike of the first of them, then it is a step. Without any
+ * value for stale_ms, failsafe is published.
+ */
+enum {
+	TH_FILTER_NONE,
+	TH_FILTER_MEDIAN,		/* param: window length */
+	TH_FILTER_EMA,			/* param: weight of a new value in percent */
+};
+
+struct cbc_th_filter {
+	char name[TH_NAME_MAX];
+	int type;
+	int param;
+	int spike;			/* 0: no spike rejection */
+	int stale_ms;			/* 0: never stale */
+	int failsafe;
+	int win[TH_FILTER_WIN_MAX];
+	int win_len;
+	int win_pos;
+	int64_t ema;			/* x100, so small steps still move it */
+	int spikes;			/* values in a row past the spike threshold */
+	int spike_val;			/* first of them */
+	int stale;
+	uint64_t last_ts;
+	unsigned int rejected;
+};
+
+/* one IOC signal: published value = raw * scale + offset */
+struct cbc_th_signal {
+	unsigned short id;
+	char name[TH_NAME_MAX];
+	int scale;
+	int offset;
+	char unit[TH_UNIT_MAX];
+	int val;
+	int raw;			/* last value of the IOC, before the filter */
+	int notified_val;
+	struct cbc_th_io *io;
+	struct cbc_th_filter *filter;
+	struct cbc_th_history history;
+	/* arrival statistics, updated by cbc_read_thread() only */
+	unsigned long updates;
+	uint64_t last_ts;
+	uint64_t interval_sum;
+	uint64_t interval_max;
+};
+
+/* cbc-signals frames seen by cbc_read_thread(), see /run/cbc_thermal/stats */
+struct cbc_th_frame_stats {
+	unsigned long frames;
+	unsigned long short_len;	/* shorter than a header and a signal */
+	unsigned long bad_header;
+	unsigned long overflow;		/* more signals announced than in the frame */
+	unsigned long unmapped;		/* signals without a config entry */
+	uint64_t process_sum;		/* ns from read() to all signals published */
+	uint64_t process_max;
 };
 
 static pthread_mutex_t cbc_th_io_lock;
 static int cbc_th_io_ready;
 static int cbc_diagnosis_fd, cbc_signals_fd;
-static int cbc_fan0_val, cbc_fan0_min_val, cbc_amplifier_temp_val, cbc_env_temp_val, cbc_ambient_temp_val;
 static int cbc_th_auto_update = 1;
+/* minimal value change to wake up pollers, 0 for any change */
+static int cbc_th_poll_delta;
+static pthread_mutex_t cbc_th_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the first one is driven by the predictors and cbc_cool0 */
+static struct cbc_th_cdev cbc_th_cdevs[TH_CDEV_MAX];
+static int cbc_th_cdevs_num;
+static struct cbc_th_cdev cbc_th_cdev_default = {
+	.name = "cbc_fan0",
+	.cmd = 0x08,
+	.report = 0x09,
+	.index = 0,
+	.duty_min = 0,
+	.duty_max = 100,
+};
+static pthread_mutex_t cbc_th_cdev_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cbc_th_cdev_cond;
+/* duty changes up to this are not sent once the IOC follows, except to 0/100 */
+static int cbc_th_fan_hysteresis;
+static int cbc_th_fan_min_interval = TH_FAN_MIN_INTERVAL_DEFAULT;
+
+static struct cbc_th_cool cbc_cool0 = {
+	.name = "cbc_cool0",
+	.fan = &cbc_th_cdevs[0],
+	.rapl = TH_RAPL_DEFAULT,
+	.rapl_fd = -1,
+	.fan_steps = 10,
+	.fan_cost = 1,
+	.rapl_steps = 10,
+	.rapl_cost = 10,
+	.rapl_min = 50,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* overridden with -m, -s and -d, e.g. for cbc_thermal_replay */
+static const char *cbc_th_io_dir = TH_IO_DIR;
+static const char *cbc_th_signals_dev = TH_SIGNALS_DEV;
+static const char *cbc_th_diagnosis_dev = TH_DIAGNOSIS_DEV;
+
+/* samples queued by cbc_trace_add(), written by cbc_trace_thread() */
+static char cbc_th_trace_dir[TH_PATH_MAX] = TH_TRACE_DIR;
+static int cbc_th_trace_max;			/* KB, 0 disables the trace */
+static int cbc_th_trace_flush = TH_TRACE_FLUSH_DEFAULT;
+static struct cbc_th_trace_rec *cbc_th_trace_ring;
+static unsigned int cbc_th_trace_head, cbc_th_trace_tail, cbc_th_trace_dropped;
+static pthread_mutex_t cbc_th_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/* writer state, only used under cbc_th_trace_write_lock */
+static pthread_mutex_t cbc_th_trace_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cbc_th_trace_boot_id[40];
+static int cbc_th_trace_fd = -1;
+static int cbc_th_trace_part;
+static off_t cbc_th_trace_size;
+static uint64_t cbc_th_trace_ts;
+static int32_t *cbc_th_trace_vals;
+
+static struct cbc_th_filter cbc_th_filters[TH_SIG_MAX];
+static int cbc_th_filters_num;
+static int cbc_th_stale_check;		/* a filter has a stale timeout */
+
+static struct cbc_th_predictor cbc_th_predictors[TH_PREDICT_MAX];
+static int cbc_th_predictors_num;
+static pthread_mutex_t cbc_th_predict_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cbc_th_predict_enable = 1;
+static int cbc_th_predict_interval = 500;	/* ms */
+static int cbc_th_predict_horizon = 10000;	/* ms */
+static int cbc_th_predict_gain = 10;		/* duty per degree C of excess */
+static int cbc_th_predict_margin = 5000;	/* mC below trip */
+static int cbc_th_predict_decay = 5;		/* max duty decrease per interval */
+static unsigned int cbc_th_history_len = TH_HISTORY_LEN_DEFAULT;
+static struct cbc_th_shm *cbc_th_shm;
+static pthread_mutex_t cbc_th_shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cbc_th_io io_inits[TH_IO_MAX];
+static int io_inits_num;
+/* open addressing hash of io node names, for lookup */
+static struct cbc_th_io *io_hash[TH_HASH_SIZE];
+
+static inline struct cbc_th_io *ino_io(fuse_ino_t ino)
+{
+	if (ino <= FUSE_ROOT_ID || ino > FUSE_ROOT_ID + io_inits_num)
+		return NULL;
+	return &io_inits[ino - FUSE_ROOT_ID - 1];
+}
+
+static struct cbc_th_signal cbc_th_signals[TH_SIG_MAX];
+static int cbc_th_signals_num;
+static struct cbc_th_frame_stats cbc_th_frame_stats;
+/* signal id -> (index + 1) in cbc_th_signals, 0 for unmapped signals */
+static unsigned char cbc_th_sig_map[TH_SIG_ID_NUM];
 
 static inline void write_exact(int fd, void *buf, int len)
 {
@@ -87,22 +390,476 @@ static inline void write_exact(int fd, void *buf, int len)
 	pthread_mutex_unlock(&cbc_th_io_lock);
 }
 
-static void *cbc_read_thread(void *arg)
+/* wake up everyone polling on io */
+static void io_notify(struct cbc_th_io *io)
+{
+	struct cbc_th_fh *fh;
+
+	if (!io)
+		return;
+	pthread_mutex_lock(&cbc_th_poll_lock);
+	io->gen++;
+	for (fh = io->fhs; fh; fh = fh->next) {
+		if (fh->ph) {
+			fuse_lowlevel_notify_poll(fh->ph);
+			fuse_pollhandle_destroy(fh->ph);
+			fh->ph = NULL;
+		}
+	}
+	pthread_mutex_unlock(&cbc_th_poll_lock);
+}
+
+static inline uint64_t cbc_th_now(void)
 {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void cbc_history_add(struct cbc_th_history *h, uint64_t ts, int val)
+{
+	struct cbc_th_history_sample *sample;
+
+	if (!h->samples)
+		return;
+	pthread_mutex_lock(&h->lock);
+	sample = &h->samples[h->head];
+	sample->ts_ns = ts;
+	sample->value = val;
+	h->head = (h->head + 1) % cbc_th_history_len;
+	if (h->count < cbc_th_history_len)
+		h->count++;
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* copy out the samples oldest first, returns the number of samples */
+static unsigned int cbc_history_copy(struct cbc_th_history *h,
+				struct cbc_th_history_sample *out)
+{
+	unsigned int first, n;
+
+	pthread_mutex_lock(&h->lock);
+	n = h->count;
+	first = (h->head + cbc_th_history_len - n) % cbc_th_history_len;
+	if (first + n <= cbc_th_history_len) {
+		memcpy(out, &h->samples[first], n * sizeof(*out));
+	} else {
+		memcpy(out, &h->samples[first], (cbc_th_history_len - first) * sizeof(*out));
+		memcpy(out + cbc_th_history_len - first, h->samples,
+			(n - (cbc_th_history_len - first)) * sizeof(*out));
+	}
+	pthread_mutex_unlock(&h->lock);
+	return n;
+}
+
+/* seqlock protected update of one shared memory entry */
+static void cbc_shm_publish(int idx, int val, uint64_t ts)
+{
+	struct cbc_th_shm_entry *e;
+
+	if (!cbc_th_shm || idx >= cbc_th_shm->count)
+		return;
+	e = &cbc_th_shm->entries[idx];
+	pthread_mutex_lock(&cbc_th_shm_lock);
+	__atomic_store_n(&cbc_th_shm->seq, cbc_th_shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&e->value, val, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->ts_ns, ts, __ATOMIC_RELAXED);
+	__atomic_store_n(&cbc_th_shm->seq, cbc_th_shm->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cbc_th_shm_lock);
+}
+
+/* queue a sample for the trace, dropped when the ring is full */
+static void cbc_trace_add(int idx, int val, uint64_t ts)
+{
+	struct cbc_th_trace_rec *r;
+
+	if (!cbc_th_trace_ring)
+		return;
+	pthread_mutex_lock(&cbc_th_trace_lock);
+	if (cbc_th_trace_head - cbc_th_trace_tail < TH_TRACE_RING) {
+		r = &cbc_th_trace_ring[cbc_th_trace_head++ % TH_TRACE_RING];
+		r->ts = ts;
+		r->val = val;
+		r->idx = idx;
+	} else {
+		cbc_th_trace_dropped++;
+	}
+	pthread_mutex_unlock(&cbc_th_trace_lock);
+}
+
+static void cbc_signal_set(struct cbc_th_signal *s, int val, uint64_t ts)
+{
+	int delta = val - s->notified_val;
+
+	s->val = val;
+	cbc_history_add(&s->history, ts, val);
+	cbc_shm_publish(s - cbc_th_signals, val, ts);
+	cbc_trace_add(s - cbc_th_signals, val, ts);
+	if (delta < 0)
+		delta = -delta;
+	if (delta > cbc_th_poll_delta || (delta && !cbc_th_poll_delta)) {
+		s->notified_val = val;
+		io_notify(s->io);
+	}
+}
+
+static void cbc_cdev_request(struct cbc_th_cdev *cdev, int duty)
+{
+	if (duty < cdev->duty_min)
+		duty = cdev->duty_min;
+	else if (duty > cdev->duty_max)
+		duty = cdev->duty_max;
+	pthread_mutex_lock(&cbc_th_cdev_lock);
+	cdev->requested++;
+	if (cdev->pending >= 0)
+		cdev->coalesced++;
+	cdev->pending = duty;
+	pthread_cond_signal(&cbc_th_cdev_cond);
+	pthread_mutex_unlock(&cbc_th_cdev_lock);
+}
+
+/* minimal duty from device range, user and predictor, whichever is higher */
+static inline int cbc_cdev_min(struct cbc_th_cdev *cdev)
+{
+	int min = cdev->min_val > cdev->predict_val ? cdev->min_val : cdev->predict_val;
+
+	if (min < cdev->duty_min)
+		min = cdev->duty_min;
+	return min > cdev->cool_val ? min : cdev->cool_val;
+}
+
+/*
+ * Called with cbc_th_cdev_lock held. Sends the pending duties of all
+ * devices of the command in one frame, the others repeat their last duty.
+ */
+static void cbc_cdev_send(unsigned char cmd_id, uint64_t now)
+{
+	unsigned char cmd[1 + TH_CDEV_INDEX_MAX] = { cmd_id };
+	int duties[TH_CDEV_MAX];
+	struct cbc_th_cdev *cdev;
+	int i, duty, len = 1, changed = 0;
+
+	CDEV_FOREACH(i, cdev) {
+		duties[i] = -1;
+		if (cdev->cmd != cmd_id)
+			continue;
+		duty = cdev->pending;
+		cdev->pending = -1;
+		if (duty >= 0 && cdev->sent >= 0 && cdev->val == cdev->sent &&
+		    abs(duty - cdev->sent) <= cbc_th_fan_hysteresis &&
+		    (duty == cdev->sent || (duty != cdev->duty_min && duty != cdev->duty_max))) {
+			/* the IOC follows the last command and the change is too small */
+			cdev->suppressed++;
+			pr_dbg("%s: suppress duty %d, sent %d\n", cdev->name, duty, cdev->sent);
+			duty = -1;
+		}
+		if (duty >= 0) {
+			if (duty == cdev->sent)
+				cdev->resent++;
+			cdev->sent_cnt++;
+			changed = 1;
+			pr_dbg("%s: send duty %d\n", cdev->name, duty);
+		} else {
+			duty = cdev->sent >= 0 ? cdev->sent : cbc_cdev_min(cdev);
+		}
+		duties[i] = duty;
+		cmd[1 + cdev->index] = (unsigned char)duty;
+		if (len < 2 + cdev->index)
+			len = 2 + cdev->index;
+	}
+	if (!changed)
+		return;
+	CDEV_FOREACH(i, cdev) {
+		if (duties[i] < 0)
+			continue;
+		cdev->sent = duties[i];
+		cdev->sent_ts = now;
+	}
+	pthread_mutex_unlock(&cbc_th_cdev_lock);
+	write_exact(cbc_diagnosis_fd, cmd, len);
+	pthread_mutex_lock(&cbc_th_cdev_lock);
+}
+
+/* send queued cooling device commands, at most one per command and min interval */
+static void *cbc_cdev_thread(void *arg)
+{
+	struct cbc_th_cdev *cdev, *ready;
+	uint64_t now, next, wait;
+	struct timespec ts;
+	int i;
+
+	pthread_mutex_lock(&cbc_th_cdev_lock);
+	while (1) {
+		now = cbc_th_now();
+		ready = NULL;
+		wait = 0;
+		CDEV_FOREACH(i, cdev) {
+			if (cdev->pending < 0)
+				continue;
+			next = cdev->sent_ts + cbc_th_fan_min_interval * 1000000ull;
+			if (cdev->sent < 0 || now >= next) {
+				ready = cdev;
+				break;
+			}
+			if (!wait || next < wait)
+				wait = next;
+		}
+		if (ready) {
+			cbc_cdev_send(ready->cmd, now);
+			continue;
+		}
+		if (!wait) {
+			pthread_cond_wait(&cbc_th_cdev_cond, &cbc_th_cdev_lock);
+			continue;
+		}
+		/* newer requests replace the pending ones meanwhile */
+		ts.tv_sec = wait / 1000000000ull;
+		ts.tv_nsec = wait % 1000000000ull;
+		pthread_cond_timedwait(&cbc_th_cdev_cond, &cbc_th_cdev_lock, &ts);
+	}
+	pthread_mutex_unlock(&cbc_th_cdev_lock);
+	return NULL;
+}
+
+/* update one of the minimal duties added to the user one, predict_val or cool_val */
+static void cbc_cdev_set_floor(struct cbc_th_cdev *cdev, int *floor, int duty)
+{
+	int old_min = cbc_cdev_min(cdev);
+	int old = *floor;
+
+	if (duty == old)
+		return;
+	*floor = duty;
+	pr_dbg("%s: minimal duty %d -> %d\n", cdev->name, old_min, cbc_cdev_min(cdev));
+	/* raise the fan, or give back what this floor added */
+	if (cbc_cdev_min(cdev) > cdev->val ||
+	    (old == old_min && old > cdev->min_val && old_min != cbc_cdev_min(cdev)))
+		cbc_cdev_request(cdev, cbc_cdev_min(cdev));
+}
+
+/* duty reported by the IOC */
+static void cbc_cdev_report(struct cbc_th_cdev *cdev, int duty)
+{
+	uint64_t now;
+
+	if (cdev->val != duty) {
+		cdev->val = duty;
+		io_notify(cdev->io);
+	}
+	now = cbc_th_now();
+	cbc_shm_publish(cbc_th_signals_num + (cdev - cbc_th_cdevs), duty, now);
+	cbc_trace_add(cbc_th_signals_num + (cdev - cbc_th_cdevs), duty, now);
+	pr_dbg("%s duty: %x\n", cdev->name, duty);
+	if (duty < cbc_cdev_min(cdev)) {
+		pr_dbg("%s duty < minimal duty, set to minimal duty: %x\n", cdev->name, cbc_cdev_min(cdev));
+		cbc_cdev_request(cdev, cbc_cdev_min(cdev));
+	}
+}
+
+static int cbc_predictor_temp(struct cbc_th_predictor *p, int *temp)
+{
+	char buf[16];
 	int len;
+
+	if (p->sig) {
+		*temp = p->sig->val;
+		return 0;
+	}
+	len = pread(p->fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	*temp = atoi(buf);
+	return 0;
+}
+
+/* called with cbc_th_predict_lock held, returns the duty needed by p */
+static int cbc_predictor_update(struct cbc_th_predictor *p, uint64_t now)
+{
+	double slope;
+	int temp, excess;
+
+	if (cbc_predictor_temp(p, &temp) < 0)
+		return 0;
+	if (p->ts) {
+		slope = (temp - p->temp) * 1e9 / (now - p->ts);
+		p->slope += TH_PREDICT_ALPHA * (slope - p->slope);
+	}
+	p->temp = temp;
+	p->ts = now;
+	p->predicted = temp + (int)(p->slope * cbc_th_predict_horizon / 1000);
+	excess = p->predicted - (p->trip - cbc_th_predict_margin);
+	p->duty = excess > 0 ? excess * cbc_th_predict_gain / 1000 : 0;
+	if (p->duty > 100)
+		p->duty = 100;
+	return p->duty;
+}
+
+/* pre-emptively raise the first fan minimal duty ahead of the trip points */
+static void *cbc_predict_thread(void *arg)
+{
+	struct timespec next;
+	uint64_t now;
+	int i, duty, last = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (1) {
+		next.tv_nsec += cbc_th_predict_interval * 1000000l;
+		next.tv_sec += next.tv_nsec / 1000000000l;
+		next.tv_nsec %= 1000000000l;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		now = cbc_th_now();
+		duty = 0;
+		pthread_mutex_lock(&cbc_th_predict_lock);
+		for (i = 0; i < cbc_th_predictors_num; i++) {
+			int d = cbc_predictor_update(&cbc_th_predictors[i], now);
+
+			if (d > duty)
+				duty = d;
+		}
+		if (!cbc_th_predict_enable)
+			duty = 0;
+		else if (duty < last - cbc_th_predict_decay)
+			duty = last - cbc_th_predict_decay;
+		last = duty;
+		pthread_mutex_unlock(&cbc_th_predict_lock);
+		cbc_cdev_set_floor(&cbc_th_cdevs[0], &cbc_th_cdevs[0].predict_val, duty);
+	}
+	return NULL;
+}
+
+static int cbc_filter_median(struct cbc_th_filter *f)
+{
+	int sorted[TH_FILTER_WIN_MAX];
+	int i, j, v;
+
+	for (i = 0; i < f->win_len; i++) {
+		v = f->win[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	return sorted[f->win_len / 2];
+}
+
+static void cbc_filter_reset(struct cbc_th_filter *f, int val)
+{
+	f->win[0] = val;
+	f->win_len = 1;
+	f->win_pos = 1 % f->param;
+	f->ema = (int64_t)val * 100;
+	f->spikes = 0;
+}
+
+/* new value of the IOC, published once filtered */
+static void cbc_signal_input(struct cbc_th_signal *s, int val, uint64_t now)
+{
+	struct cbc_th_filter *f = s->filter;
+
+	if (s->updates++) {
+		s->interval_sum += now - s->last_ts;
+		if (now - s->last_ts > s->interval_max)
+			s->interval_max = now - s->last_ts;
+	}
+	s->last_ts = now;
+	s->raw = val;
+	if (!f) {
+		cbc_signal_set(s, val, now);
+		return;
+	}
+	f->last_ts = now;
+	if (f->stale || !f->win_len) {
+		if (f->stale)
+			pr_log("%s: updated again\n", s->name);
+		f->stale = 0;
+		cbc_filter_reset(f, val);
+		cbc_signal_set(s, val, now);
+		return;
+	}
+	if (f->spike && abs(val - s->val) > f->spike) {
+		/* outliers which disagree with each other are noise */
+		if (!f->spikes || abs(val - f->spike_val) > f->spike) {
+			f->spikes = 0;
+			f->spike_val = val;
+		}
+		if (++f->spikes < TH_SPIKE_CONFIRM) {
+			f->rejected++;
+			pr_dbg("%s: spike %d rejected\n", s->name, val);
+			return;
+		}
+		/* a real step, do not let the old values slow it down */
+		cbc_filter_reset(f, val);
+		cbc_signal_set(s, val, now);
+		return;
+	}
+	f->spikes = 0;
+	switch (f->type) {
+	case TH_FILTER_MEDIAN:
+		f->win[f->win_pos] = val;
+		f->win_pos = (f->win_pos + 1) % f->param;
+		if (f->win_len < f->param)
+			f->win_len++;
+		val = cbc_filter_median(f);
+		break;
+	case TH_FILTER_EMA:
+		f->ema += ((int64_t)val * 100 - f->ema) * f->param / 100;
+		val = (int)((f->ema + (f->ema < 0 ? -50 : 50)) / 100);
+		break;
+	}
+	cbc_signal_set(s, val, now);
+}
+
+/* publish the failsafe value of the signals the IOC stopped sending */
+static void cbc_signal_stale_check(uint64_t now)
+{
+	struct cbc_th_signal *s;
+	int i;
+
+	SIG_FOREACH(i, s) {
+		struct cbc_th_filter *f = s->filter;
+
+		if (!f || !f->stale_ms || f->stale ||
+		    now - f->last_ts < (uint64_t)f->stale_ms * 1000000)
+			continue;
+		f->stale = 1;
+		pr_log("%s: no update for %d ms, failsafe %d\n", s->name, f->stale_ms, f->failsafe);
+		cbc_signal_set(s, f->failsafe, now);
+	}
+}
+
+static void *cbc_read_thread(void *arg)
+{
+	int len, i;
 	unsigned char buf[4096];
+	struct cbc_th_signal *s;
+	struct cbc_th_cdev *cdev;
+	struct timeval tv;
 	fd_set rfd;
 	int max_fd = cbc_signals_fd > cbc_diagnosis_fd ? cbc_signals_fd : cbc_diagnosis_fd;
 
 	write_exact(cbc_signals_fd, "\xff", 1);
-	write_exact(cbc_diagnosis_fd, "\x08\x64", 2);
+	CDEV_FOREACH(i, cdev)
+		cbc_cdev_request(cdev, cdev->duty_max);
+
+	/* stale timeouts run from the start, the IOC may never send */
+	SIG_FOREACH(i, s)
+		if (s->filter)
+			s->filter->last_ts = cbc_th_now();
 
 	cbc_th_io_ready = 1;
 	while (1) {
 		FD_ZERO(&rfd);
 		FD_SET(cbc_signals_fd, &rfd);
 		FD_SET(cbc_diagnosis_fd, &rfd);
-		select(max_fd + 1, &rfd, NULL, NULL, NULL);
+		tv.tv_sec = 0;
+		tv.tv_usec = TH_STALE_CHECK * 1000;
+		if (select(max_fd + 1, &rfd, NULL, NULL, cbc_th_stale_check ? &tv : NULL) <= 0)
+			FD_ZERO(&rfd);
+		if (cbc_th_stale_check && cbc_th_auto_update)
+			cbc_signal_stale_check(cbc_th_now());
 		if (!cbc_th_auto_update && FD_ISSET(cbc_signals_fd, &rfd)) {
 			len = read(cbc_signals_fd, buf, sizeof(buf));
 			FD_CLR(cbc_signals_fd, &rfd);
@@ -112,107 +869,366 @@ static void *cbc_read_thread(void *arg)
 			unsigned char *sig;
 			unsigned short sig_id;
 			unsigned int sig_val;
+			uint64_t now;
 
 			len = read(cbc_signals_fd, buf, sizeof(buf));
+			now = cbc_th_now();
 			pr_dump(buf, len, "cbc_signals: ");
-			if (len < 4 || buf[0] != 0x2)
+			cbc_th_frame_stats.frames++;
+			if (len < 4) {
+				cbc_th_frame_stats.short_len++;
 				continue;
+			}
+			if (buf[0] != 0x2) {
+				cbc_th_frame_stats.bad_header++;
+				continue;
+			}
 			num = buf[1];
+			if (2 + num * 6 > len) {
+				/* keep the signals which are complete */
+				cbc_th_frame_stats.overflow++;
+				num = (len - 2) / 6;
+			}
 			sig = &buf[2];
 			pr_dbg("sig num=%d\n", num);
 			for (sig = &buf[2], i = 0; i < num; sig += 6, i ++) {
+				int idx;
+
 				sig_id = sig[0] + (sig[1] << 8);
 				sig_val = sig[2] + (sig[3] << 8);
 				pr_dbg("sig: id=%d, val=%x\n", sig_id, sig_val);
-				if (sig_id == 502) {
-					cbc_amplifier_temp_val = sig_val * 10 - 100000;
-					pr_dbg("cbc_amplifier_temp_val=%x\n", cbc_amplifier_temp_val);
-				}
-				if (sig_id == 503) {
-					cbc_env_temp_val = sig_val * 10 - 100000;
-					pr_dbg("cbc_env_temp_val=%x\n", cbc_env_temp_val);
-				}
-				if (sig_id == 870) {
-					cbc_ambient_temp_val = sig_val * 10 - 100000;
-					pr_dbg("cbc_ambient_temp_val=%x\n", cbc_ambient_temp_val);
+				idx = cbc_th_sig_map[sig_id];
+				if (!idx) {
+					cbc_th_frame_stats.unmapped++;
+					continue;
 				}
+				s = &cbc_th_signals[idx - 1];
+				cbc_signal_input(s, (int)sig_val * s->scale + s->offset, now);
+				pr_dbg("%s=%d%s\n", s->name, s->val, s->unit);
 			}
+			now = cbc_th_now() - now;
+			cbc_th_frame_stats.process_sum += now;
+			if (now > cbc_th_frame_stats.process_max)
+				cbc_th_frame_stats.process_max = now;
 		}
 		if (FD_ISSET(cbc_diagnosis_fd, &rfd)) {
 			len = read(cbc_diagnosis_fd, buf, sizeof(buf));
 			pr_dump(buf, len, "cbc_diagnosis: ");
-			if (len == 4 && buf[0] == 0x9) {
-				cbc_fan0_val = buf[1];
-				pr_dbg("cbc fan0 duty: %x\n", cbc_fan0_val);
-				if (cbc_fan0_val < cbc_fan0_min_val) {
-					unsigned char cmd[] = {0x08, 0};
-					cmd[1] = (unsigned char)cbc_fan0_min_val;
-					pr_dbg("cbc fan0 duty < minimal duty, set to minimal duty: %x\n", cbc_fan0_min_val);
-					write_exact(cbc_diagnosis_fd, cmd, sizeof(cmd));
-				}
-			}
+			CDEV_FOREACH(i, cdev)
+				if (len >= 2 + cdev->index && buf[0] == cdev->report)
+					cbc_cdev_report(cdev, buf[1 + cdev->index]);
 		}
 	}
 	return NULL;
 }
 
-static int cbc_amplifier_temp_read(char *buf, int len, void *data)
+static int cbc_signal_read(char *buf, int len, void *data)
 {
-	int ret = snprintf(buf, len, "%d", cbc_amplifier_temp_val);
-	pr_dbg("%s: %s\n", __func__, buf);
+	struct cbc_th_signal *s = data;
+	int ret = snprintf(buf, len, "%d", s->val);
+	pr_dbg("%s: %s\n", s->name, buf);
 	return ret;
 }
 
-static int cbc_amplifier_temp_write(char *buf, int len, void *data)
+static int cbc_signal_raw_read(char *buf, int len, void *data)
+{
+	struct cbc_th_signal *s = data;
+
+	return snprintf(buf, len, "%d", s->raw);
+}
+
+static int cbc_signal_write(char *buf, int len, void *data)
 {
-	cbc_amplifier_temp_val = atoi(buf);
-	pr_log("%s: %d\n", __func__, cbc_amplifier_temp_val);
+	struct cbc_th_signal *s = data;
+
+	cbc_signal_set(s, atoi(buf), cbc_th_now());
+	pr_log("%s: %d\n", s->name, s->val);
 	return len;
 }
 
-static int cbc_env_temp_read(char *buf, int len, void *data)
+static char *cbc_history_dump(size_t *len, void *data)
 {
-	int ret = snprintf(buf, len, "%d", cbc_env_temp_val);
-	pr_dbg("%s: %s\n", __func__, buf);
+	struct cbc_th_signal *s = data;
+	struct cbc_th_history_header *hdr;
+	char *buf;
+
+	buf = malloc(sizeof(*hdr) + cbc_th_history_len * sizeof(struct cbc_th_history_sample));
+	if (!buf)
+		return NULL;
+	hdr = (struct cbc_th_history_header *)buf;
+	hdr->magic = CBC_TH_HISTORY_MAGIC;
+	hdr->version = CBC_TH_HISTORY_VERSION;
+	hdr->sample_size = sizeof(struct cbc_th_history_sample);
+	hdr->capacity = cbc_th_history_len;
+	hdr->count = cbc_history_copy(&s->history,
+			(struct cbc_th_history_sample *)(buf + sizeof(*hdr)));
+	*len = sizeof(*hdr) + hdr->count * sizeof(struct cbc_th_history_sample);
+	return buf;
+}
+
+/* "<sec>.<nsec> <value>", 20 + 1 + 9 + 1 + 11 + 1 */
+#define TH_HISTORY_LINE_MAX 44
+static char *cbc_history_dump_txt(size_t *len, void *data)
+{
+	struct cbc_th_signal *s = data;
+	struct cbc_th_history_sample *samples, *sample;
+	unsigned int i, n;
+	char *buf;
+	size_t pos = 0;
+
+	samples = malloc(cbc_th_history_len * sizeof(*samples));
+	buf = malloc(cbc_th_history_len * TH_HISTORY_LINE_MAX + 1);
+	if (!samples || !buf) {
+		free(samples);
+		free(buf);
+		return NULL;
+	}
+	n = cbc_history_copy(&s->history, samples);
+	for (i = 0, sample = samples; i < n; i++, sample++)
+		pos += snprintf(buf + pos, TH_HISTORY_LINE_MAX + 1, "%llu.%09llu %d\n",
+			(unsigned long long)(sample->ts_ns / 1000000000ull),
+			(unsigned long long)(sample->ts_ns % 1000000000ull),
+			sample->value);
+	free(samples);
+	*len = pos;
+	return buf;
+}
+
+static int cbc_cdev_read(char *buf, int len, void *data)
+{
+	struct cbc_th_cdev *cdev = data;
+	int ret = snprintf(buf, len, "%d", cdev->val);
+	pr_dbg("%s: %s\n", cdev->name, buf);
 	return ret;
 }
 
-static int cbc_env_temp_write(char *buf, int len, void *data)
+static int cbc_cdev_write(char *buf, int len, void *data)
 {
-	cbc_env_temp_val = atoi(buf);
-	pr_log("%s: %d\n", __func__, cbc_env_temp_val);
+	struct cbc_th_cdev *cdev = data;
+
+	cdev->min_val = (unsigned char)atoi(buf);
+	pr_log("%s: duty=%d\n", cdev->name, cdev->min_val);
+	cbc_cdev_request(cdev, cbc_cdev_min(cdev));
 	return len;
 }
 
-static int cbc_ambient_temp_read(char *buf, int len, void *data)
+/* counters written by cbc_read_thread() without lock, a snapshot may be slightly off */
+static char *cbc_stats_dump(size_t *len, void *data)
 {
-	int ret = snprintf(buf, len, "%d", cbc_ambient_temp_val);
-	pr_dbg("%s: %s\n", __func__, buf);
-	return ret;
+	struct cbc_th_frame_stats *fs = &cbc_th_frame_stats;
+	size_t size = TH_IOBUF_MAX * 2 * (8 + cbc_th_signals_num);
+	char *buf = malloc(size);
+	struct cbc_th_signal *s;
+	uint64_t now = cbc_th_now();
+	unsigned long frames;
+	int i, n;
+
+	if (!buf)
+		return NULL;
+	frames = fs->frames - fs->short_len - fs->bad_header;
+	n = snprintf(buf, size,
+		"frames %lu\nshort %lu\nbad_header %lu\noverflow %lu\nunmapped %lu\n"
+		"process_us_mean %llu\nprocess_us_max %llu\n",
+		fs->frames, fs->short_len, fs->bad_header, fs->overflow, fs->unmapped,
+		(unsigned long long)(frames ? fs->process_sum / frames / 1000 : 0),
+		(unsigned long long)(fs->process_max / 1000));
+	SIG_FOREACH(i, s) {
+		if (n >= (int)size)
+			break;
+		n += snprintf(buf + n, size - n,
+			"%s id %u updates %lu interval_ms_mean %llu interval_ms_max %llu age_ms %lld\n",
+			s->name, s->id, s->updates,
+			(unsigned long long)(s->updates > 1 ?
+				s->interval_sum / (s->updates - 1) / 1000000 : 0),
+			(unsigned long long)(s->interval_max / 1000000),
+			s->updates ? (long long)((now - s->last_ts) / 1000000) : -1ll);
+	}
+	/* cut output, snprintf() returned the full length */
+	if (n >= (int)size)
+		n = size - 1;
+	*len = n;
+	return buf;
+}
+
+static char *cbc_cdev_stats_dump(size_t *len, void *data)
+{
+	struct cbc_th_cdev *cdev = data;
+	char *buf = malloc(TH_IOBUF_MAX * 8);
+	int n;
+
+	if (!buf)
+		return NULL;
+	pthread_mutex_lock(&cbc_th_cdev_lock);
+	n = snprintf(buf, TH_IOBUF_MAX * 8,
+		"requested %lu\ncoalesced %lu\nsuppressed %lu\nsent %lu\nresent %lu\n"
+		"last_sent %d\nreported %d\n",
+		cdev->requested, cdev->coalesced, cdev->suppressed, cdev->sent_cnt,
+		cdev->resent, cdev->sent, cdev->val);
+	pthread_mutex_unlock(&cbc_th_cdev_lock);
+	*len = n;
+	return buf;
 }
 
-static int cbc_ambient_temp_write(char *buf, int len, void *data)
+static int cbc_cool_max_state(struct cbc_th_cool *cool)
 {
-	cbc_ambient_temp_val = atoi(buf);
-	pr_log("%s: %d\n", __func__, cbc_ambient_temp_val);
+	return cool->fan_steps + (cool->rapl_fd >= 0 ? cool->rapl_steps : 0);
+}
+
+/* called with cool->lock held */
+static void cbc_cool_apply(struct cbc_th_cool *cool)
+{
+	int fan_state, rapl_state, rapl_steps = cool->rapl_fd >= 0 ? cool->rapl_steps : 0;
+	char buf[TH_IOBUF_MAX];
+	long uw;
+
+	if (cool->fan_cost <= cool->rapl_cost) {
+		fan_state = cool->state < cool->fan_steps ? cool->state : cool->fan_steps;
+		rapl_state = cool->state - fan_state;
+	} else {
+		rapl_state = cool->state < rapl_steps ? cool->state : rapl_steps;
+		fan_state = cool->state - rapl_state;
+	}
+	cbc_cdev_set_floor(cool->fan, &cool->fan->cool_val,
+		cool->fan_steps ? fan_state * 100 / cool->fan_steps : 0);
+	if (!rapl_steps)
+		return;
+	uw = cool->rapl_orig - (cool->rapl_orig - cool->rapl_orig / 100 * cool->rapl_min) *
+		rapl_state / rapl_steps;
+	if (uw == cool->rapl_val)
+		return;
+	snprintf(buf, sizeof(buf), "%ld", uw);
+	if (pwrite(cool->rapl_fd, buf, strlen(buf), 0) < 0) {
+		pr_log("%s: write %s error: %s\n", cool->name, cool->rapl, strerror(errno));
+		return;
+	}
+	pr_dbg("%s: %s=%ld\n", cool->name, cool->rapl, uw);
+	cool->rapl_val = uw;
+}
+
+static int cbc_cool_read(char *buf, int len, void *data)
+{
+	struct cbc_th_cool *cool = data;
+
+	return snprintf(buf, len, "%d", cool->state);
+}
+
+static int cbc_cool_write(char *buf, int len, void *data)
+{
+	struct cbc_th_cool *cool = data;
+	int state = atoi(buf);
+
+	pthread_mutex_lock(&cool->lock);
+	if (state < 0)
+		state = 0;
+	if (state > cbc_cool_max_state(cool))
+		state = cbc_cool_max_state(cool);
+	cool->state = state;
+	cbc_cool_apply(cool);
+	pthread_mutex_unlock(&cool->lock);
+	pr_log("%s: state=%d\n", cool->name, state);
 	return len;
 }
 
-static int cbc_fan0_read(char *buf, int len, void *data)
+static char *cbc_cool_info_dump(size_t *len, void *data)
 {
-	int ret = snprintf(buf, len, "%d", cbc_fan0_val);
-	pr_dbg("%s: %s\n", __func__, buf);
-	return ret;
+	struct cbc_th_cool *cool = data;
+	char *buf = malloc(TH_IOBUF_MAX * 8);
+	int n;
+
+	if (!buf)
+		return NULL;
+	pthread_mutex_lock(&cool->lock);
+	n = snprintf(buf, TH_IOBUF_MAX * 8,
+		"state %d\nmax_state %d\nfan_duty %d\nrapl %s\nrapl_limit_uw %ld\nrapl_orig_uw %ld\n",
+		cool->state, cbc_cool_max_state(cool), cool->fan->cool_val,
+		cool->rapl_fd >= 0 ? cool->rapl : "none", cool->rapl_val, cool->rapl_orig);
+	pthread_mutex_unlock(&cool->lock);
+	*len = n;
+	return buf;
+}
+
+/* give the power limit back, cbc_thermal must not leave the CPU throttled */
+static void cbc_cool_restore(struct cbc_th_cool *cool)
+{
+	pthread_mutex_lock(&cool->lock);
+	cool->state = 0;
+	if (cool->rapl_fd >= 0)
+		cbc_cool_apply(cool);
+	pthread_mutex_unlock(&cool->lock);
+}
+
+/*
+ * On exit(), ASSERT included, and on a fatal signal outside the FUSE
+ * loop. The lock is not taken, its holder may be the exiting thread.
+ * Async-signal-safe.
+ */
+static void cbc_cool_restore_exit(void)
+{
+	struct cbc_th_cool *cool = &cbc_cool0;
+
+	if (cool->rapl_fd >= 0 && cool->rapl_val != cool->rapl_orig &&
+	    pwrite(cool->rapl_fd, cool->rapl_orig_buf, strlen(cool->rapl_orig_buf), 0) > 0)
+		cool->rapl_val = cool->rapl_orig;
+}
+
+static void cbc_cool_signal(int sig)
+{
+	cbc_cool_restore_exit();
+	signal(sig, SIG_DFL);
+	raise(sig);
 }
 
-static int cbc_fan0_write(char *buf, int len, void *data)
+static char *cbc_predict_dump(size_t *len, void *data)
 {
-	unsigned char cmd[] = {0x08, 0};
-	cmd[1] = (unsigned char)atoi(buf);
+	struct cbc_th_predictor *p;
+	size_t size = TH_IOBUF_MAX * (8 + TH_PREDICT_MAX * 2);
+	char *buf = malloc(size);
+	int i, n;
 
-	cbc_fan0_min_val = (int)cmd[1];
-	pr_log("%s: duty=%d\n", __func__, cbc_fan0_min_val);
-	write_exact(cbc_diagnosis_fd, cmd, sizeof(cmd));
+	if (!buf)
+		return NULL;
+	pthread_mutex_lock(&cbc_th_predict_lock);
+	n = snprintf(buf, size,
+		"enable %d\ninterval_ms %d\nhorizon_ms %d\ngain %d\nmargin %d\ndecay %d\nduty %d\n",
+		cbc_th_predict_enable, cbc_th_predict_interval, cbc_th_predict_horizon,
+		cbc_th_predict_gain, cbc_th_predict_margin, cbc_th_predict_decay,
+		cbc_th_cdevs[0].predict_val);
+	for (i = 0, p = cbc_th_predictors; i < cbc_th_predictors_num && n < (int)size; i++, p++)
+		n += snprintf(buf + n, size - n, "%s trip %d temp %d slope %d predicted %d duty %d\n",
+			p->name, p->trip, p->temp, (int)p->slope, p->predicted, p->duty);
+	pthread_mutex_unlock(&cbc_th_predict_lock);
+	/* cut output, snprintf() returned the full length */
+	if (n >= (int)size)
+		n = size - 1;
+	*len = n;
+	return buf;
+}
+
+/* "<tunable> <value>" */
+static int cbc_predict_write(char *buf, int len, void *data)
+{
+	char key[32];
+	int val;
+
+	if (sscanf(buf, "%31s %d", key, &val) != 2) {
+		pr_log("%s: invalid write: %s\n", __func__, buf);
+		return len;
+	}
+	pthread_mutex_lock(&cbc_th_predict_lock);
+	if (strcmp(key, "enable") == 0)
+		cbc_th_predict_enable = !!val;
+	else if (strcmp(key, "horizon_ms") == 0 && val >= 0)
+		cbc_th_predict_horizon = val;
+	else if (strcmp(key, "gain") == 0 && val >= 0)
+		cbc_th_predict_gain = val;
+	else if (strcmp(key, "margin") == 0)
+		cbc_th_predict_margin = val;
+	else if (strcmp(key, "decay") == 0 && val > 0)
+		cbc_th_predict_decay = val;
+	else
+		pr_log("%s: invalid write: %s\n", __func__, buf);
+	pthread_mutex_unlock(&cbc_th_predict_lock);
+	pr_log("%s: %s %d\n", __func__, key, val);
 	return len;
 }
 
@@ -230,32 +1246,42 @@ static int auto_update_write(char *buf, int len, void *data)
 	return len;
 }
 
-#define IO_INITS_NUM (sizeof(io_inits)/sizeof(io_inits[0]))
-static struct cbc_th_io io_inits[] = {
-/* sensors */
+/* used when no signal map config file can be found */
+static struct cbc_th_signal cbc_th_signals_default[] = {
 	{
 		/* IasTemperatureSensorAmplifier */
+		.id = 502,
 		.name = "cbc_amplifier_temp",
-		.read = cbc_amplifier_temp_read,
-		.write = cbc_amplifier_temp_write,
+		.scale = 10,
+		.offset = -100000,
+		.unit = "mC",
 	},
 	{
 		/* IasTemperatureSensorEnvironment */
+		.id = 503,
 		.name = "cbc_env_temp",
-		.read = cbc_env_temp_read,
-		.write = cbc_env_temp_write,
+		.scale = 10,
+		.offset = -100000,
+		.unit = "mC",
 	},
 	{
 		/* IasAmbientTemperature */
+		.id = 870,
 		.name = "cbc_ambient_temp",
-		.read = cbc_ambient_temp_read,
-		.write = cbc_ambient_temp_write,
+		.scale = 10,
+		.offset = -100000,
+		.unit = "mC",
 	},
+};
+
+#define IO_STATICS_NUM (sizeof(io_statics)/sizeof(io_statics[0]))
+static struct cbc_th_io io_statics[] = {
 /* cooling devices */
 	{
-		.name = "cbc_fan0",
-		.read = cbc_fan0_read,
-		.write = cbc_fan0_write,
+		.name = "cbc_cool0",
+		.read = cbc_cool_read,
+		.write = cbc_cool_write,
+		.data = &cbc_cool0,
 	},
 /* control */
 	{
@@ -265,111 +1291,1078 @@ static struct cbc_th_io io_inits[] = {
 	},
 };
 
-static int io_getattr(const char *path, struct stat *stbuf)
+static unsigned int io_hash_slot(struct cbc_th_io *parent, const char *name)
 {
-	int res = 0;
+	unsigned int h = 2166136261u;
 
-	memset(stbuf, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	} else {
-		stbuf->st_mode = S_IFREG | 0644;
-		stbuf->st_nlink = 1;
-		stbuf->st_size = 4096;
+	if (parent)
+		h = (h ^ (unsigned int)(parent - io_inits)) * 16777619u;
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h & (TH_HASH_SIZE - 1);
+}
+
+static struct cbc_th_io *io_lookup(struct cbc_th_io *parent, const char *name)
+{
+	unsigned int slot = io_hash_slot(parent, name);
+	struct cbc_th_io *io;
+
+	while ((io = io_hash[slot])) {
+		if (io->parent == parent && strcmp(io->name, name) == 0)
+			return io;
+		slot = (slot + 1) & (TH_HASH_SIZE - 1);
 	}
-	return res;
+	return NULL;
 }
 
-static int io_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
+static struct cbc_th_io *io_add(struct cbc_th_io *parent, char *name)
 {
-	int i;
+	unsigned int slot;
 	struct cbc_th_io *io;
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	IO_FOREACH(i, io) {
-		filler(buf, io->name, NULL, 0);
+	if (io_lookup(parent, name)) {
+		pr_log("duplicated io node %s, ignored\n", name);
+		return NULL;
+	}
+	if (io_inits_num >= TH_IO_MAX) {
+		pr_log("too many io nodes, %s ignored\n", name);
+		return NULL;
+	}
+	io = &io_inits[io_inits_num++];
+	io->name = name;
+	io->parent = parent;
+	/* the hash is twice as large as io_inits, there is always a free slot */
+	slot = io_hash_slot(parent, name);
+	while (io_hash[slot])
+		slot = (slot + 1) & (TH_HASH_SIZE - 1);
+	io_hash[slot] = io;
+	return io;
+}
+
+static struct cbc_th_io *io_register(char *name,
+		int (*read)(char *buf, int len, void *data),
+		int (*write)(char *buf, int len, void *data),
+		void *data)
+{
+	struct cbc_th_io *io = io_add(NULL, name);
+
+	if (io) {
+		io->read = read;
+		io->write = write;
+		io->data = data;
+	}
+	return io;
+}
+
+static struct cbc_th_io *io_register_dir(struct cbc_th_io *parent, char *name)
+{
+	struct cbc_th_io *io = io_lookup(parent, name);
+
+	if (io)
+		return io->is_dir ? io : NULL;
+	io = io_add(parent, name);
+	if (io)
+		io->is_dir = 1;
+	return io;
+}
+
+static struct cbc_th_io *io_register_dump(struct cbc_th_io *parent, char *name,
+		char *(*dump)(size_t *len, void *data), void *data)
+{
+	struct cbc_th_io *io = io_add(parent, name);
+
+	if (io) {
+		io->dump = dump;
+		io->data = data;
+	}
+	return io;
+}
+
+static void cbc_history_init(struct cbc_th_signal *s)
+{
+	struct cbc_th_io *dir = io_register_dir(NULL, TH_HISTORY_DIR);
+	size_t len = strlen(s->name) + sizeof(".txt");
+	char *txt_name = malloc(len);
+
+	if (!dir || !txt_name)
+		return;
+	s->history.samples = calloc(cbc_th_history_len, sizeof(struct cbc_th_history_sample));
+	ASSERT(s->history.samples, "alloc %s history error\n", s->name);
+	pthread_mutex_init(&s->history.lock, NULL);
+	io_register_dump(dir, s->name, cbc_history_dump, s);
+	snprintf(txt_name, len, "%s.txt", s->name);
+	io_register_dump(dir, txt_name, cbc_history_dump_txt, s);
+}
+
+static int cbc_signal_add(struct cbc_th_signal *sig)
+{
+	struct cbc_th_signal *s;
+
+	if (cbc_th_sig_map[sig->id]) {
+		pr_log("signal %d already mapped to %s, %s ignored\n", sig->id,
+			cbc_th_signals[cbc_th_sig_map[sig->id] - 1].name, sig->name);
+		return -1;
+	}
+	if (cbc_th_signals_num >= TH_SIG_MAX) {
+		pr_log("too many signals, %s ignored\n", sig->name);
+		return -1;
 	}
+	s = &cbc_th_signals[cbc_th_signals_num];
+	*s = *sig;
+	s->io = io_register(s->name, cbc_signal_read, cbc_signal_write, s);
+	if (!s->io)
+		return -1;
+	cbc_th_sig_map[s->id] = ++cbc_th_signals_num;
+	pr_log("signal %d -> %s (x%d %+d %s)\n", s->id, s->name, s->scale, s->offset, s->unit);
 	return 0;
 }
 
-static int io_truncate(const char *path, off_t size)
+/*
+ * Config file, one entry per line:
+ *	signal | <id> | <name> | <scale> | <offset> | [unit]
+ *	option | <name> | <value>
+ *	predict | <sensor> | <trip>
+ *	rapl | <power limit file>
+ *	trace | <directory>
+ *	fan | <name> | <cmd> | <index> | <min> | <max> | <report>
+ *	filter | <sensor> | none/median/ema | <param> | <spike> | <stale ms> | <failsafe>
+ * Lines starting with '#' are comments.
+ */
+static void cbc_th_option_set(const char *name, int val)
 {
-        return 0;
+	if (strcmp(name, "poll_delta") == 0)
+		cbc_th_poll_delta = val < 0 ? -val : val;
+	else if (strcmp(name, "history_len") == 0)
+		cbc_th_history_len = val > 0 ? val : 0;
+	else if (strcmp(name, "fan_hysteresis") == 0)
+		cbc_th_fan_hysteresis = val > 0 ? val : 0;
+	else if (strcmp(name, "fan_min_interval_ms") == 0)
+		cbc_th_fan_min_interval = val > 0 ? val : 0;
+	else if (strcmp(name, "trace_max_kb") == 0)
+		cbc_th_trace_max = val > 0 ? val : 0;
+	else if (strcmp(name, "trace_flush_ms") == 0 && val > 0)
+		cbc_th_trace_flush = val;
+	else if (strcmp(name, "cool_fan_steps") == 0)
+		cbc_cool0.fan_steps = val > 0 ? val : 0;
+	else if (strcmp(name, "cool_fan_cost") == 0)
+		cbc_cool0.fan_cost = val;
+	else if (strcmp(name, "cool_rapl_steps") == 0)
+		cbc_cool0.rapl_steps = val > 0 ? val : 0;
+	else if (strcmp(name, "cool_rapl_cost") == 0)
+		cbc_cool0.rapl_cost = val;
+	else if (strcmp(name, "cool_rapl_min") == 0 && val >= 0 && val <= 100)
+		cbc_cool0.rapl_min = val;
+	else if (strcmp(name, "predict_interval_ms") == 0 && val > 0)
+		cbc_th_predict_interval = val;
+	else if (strcmp(name, "predict_horizon_ms") == 0 && val >= 0)
+		cbc_th_predict_horizon = val;
+	else if (strcmp(name, "predict_gain") == 0 && val >= 0)
+		cbc_th_predict_gain = val;
+	else if (strcmp(name, "predict_margin") == 0)
+		cbc_th_predict_margin = val;
+	else if (strcmp(name, "predict_decay") == 0 && val > 0)
+		cbc_th_predict_decay = val;
+	else
+		pr_log("unknown option %s\n", name);
 }
 
-static int io_write(const char *path, const char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
+static int cbc_th_conf_load(const char *path)
 {
+	FILE *file = fopen(path, "r");
+	char line[256];
+	char key[32];
+	char name[TH_NAME_MAX];
+	unsigned int id;
+	int n, val, lineno = 0;
+	struct cbc_th_signal sig;
+
+	if (!file)
+		return -1;
+	pr_log("load config %s\n", path);
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		if (sscanf(line, "%31s", key) != 1 || key[0] == '#')
+			continue;
+		if (strcmp(key, "signal") == 0) {
+			memset(&sig, 0, sizeof(sig));
+			n = sscanf(line, "%*s | %u | %63s | %d | %d | %15s", &id,
+				sig.name, &sig.scale, &sig.offset, sig.unit);
+			if (n < 4 || id >= TH_SIG_ID_NUM) {
+				pr_log("%s:%d: invalid signal entry\n", path, lineno);
+				continue;
+			}
+			sig.id = (unsigned short)id;
+			cbc_signal_add(&sig);
+		} else if (strcmp(key, "option") == 0) {
+			if (sscanf(line, "%*s | %63s | %d", name, &val) != 2) {
+				pr_log("%s:%d: invalid option entry\n", path, lineno);
+				continue;
+			}
+			cbc_th_option_set(name, val);
+		} else if (strcmp(key, "fan") == 0) {
+			struct cbc_th_cdev *cdev = &cbc_th_cdevs[cbc_th_cdevs_num];
+			unsigned int cmd, report;
+
+			if (cbc_th_cdevs_num >= TH_CDEV_MAX) {
+				pr_log("%s:%d: too many fan entries\n", path, lineno);
+				continue;
+			}
+			memset(cdev, 0, sizeof(*cdev));
+			if (sscanf(line, "%*s | %63s | %i | %d | %d | %d | %i", cdev->name, &cmd,
+				   &cdev->index, &cdev->duty_min, &cdev->duty_max, &report) != 6 ||
+			    cmd > 0xff || report > 0xff || cdev->index < 0 ||
+			    cdev->index >= TH_CDEV_INDEX_MAX || cdev->duty_min < 0 ||
+			    cdev->duty_min > cdev->duty_max || cdev->duty_max > 100) {
+				pr_log("%s:%d: invalid fan entry\n", path, lineno);
+				continue;
+			}
+			cdev->cmd = cmd;
+			cdev->report = report;
+			cbc_th_cdevs_num++;
+		} else if (strcmp(key, "filter") == 0) {
+			struct cbc_th_filter *f = &cbc_th_filters[cbc_th_filters_num];
+			char type[16];
+
+			if (cbc_th_filters_num >= TH_SIG_MAX ||
+			    sscanf(line, "%*s | %63s | %15s | %d | %d | %d | %d", f->name, type,
+				   &f->param, &f->spike, &f->stale_ms, &f->failsafe) != 6) {
+				pr_log("%s:%d: invalid filter entry\n", path, lineno);
+				continue;
+			}
+			if (strcmp(type, "median") == 0 && f->param > 0 && f->param <= TH_FILTER_WIN_MAX)
+				f->type = TH_FILTER_MEDIAN;
+			else if (strcmp(type, "ema") == 0 && f->param > 0 && f->param <= 100)
+				f->type = TH_FILTER_EMA;
+			else if (strcmp(type, "none") == 0)
+				f->type = TH_FILTER_NONE;
+			else {
+				pr_log("%s:%d: invalid filter %s %d\n", path, lineno, type, f->param);
+				continue;
+			}
+			if (f->type == TH_FILTER_NONE)
+				f->param = 1;
+			cbc_th_filters_num++;
+		} else if (strcmp(key, "trace") == 0) {
+			if (sscanf(line, "%*s | %127s", cbc_th_trace_dir) != 1)
+				pr_log("%s:%d: invalid trace entry\n", path, lineno);
+		} else if (strcmp(key, "rapl") == 0) {
+			if (sscanf(line, "%*s | %127s", cbc_cool0.rapl) != 1)
+				pr_log("%s:%d: invalid rapl entry\n", path, lineno);
+		} else if (strcmp(key, "predict") == 0) {
+			struct cbc_th_predictor *p = &cbc_th_predictors[cbc_th_predictors_num];
+
+			if (cbc_th_predictors_num >= TH_PREDICT_MAX ||
+			    sscanf(line, "%*s | %63s | %d", p->name, &p->trip) != 2) {
+				pr_log("%s:%d: invalid predict entry\n", path, lineno);
+				continue;
+			}
+			p->fd = -1;
+			cbc_th_predictors_num++;
+		} else {
+			pr_log("%s:%d: unknown entry %s\n", path, lineno, key);
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+static void cbc_cdev_init(struct cbc_th_cdev *cdev)
+{
+	size_t len = strlen(cdev->name) + sizeof("_stats");
+	char *stats_name = malloc(len);
+
+	cdev->pending = -1;
+	cdev->sent = -1;
+	cdev->io = io_register(cdev->name, cbc_cdev_read, cbc_cdev_write, cdev);
+	if (!stats_name)
+		return;
+	snprintf(stats_name, len, "%s_stats", cdev->name);
+	io_register_dump(NULL, stats_name, cbc_cdev_stats_dump, cdev);
+	pr_log("cooling device %s: cmd 0x%02x index %d duty %d-%d report 0x%02x\n", cdev->name,
+		cdev->cmd, cdev->index, cdev->duty_min, cdev->duty_max, cdev->report);
+}
+
+/* sensor of a predictor: a CBC signal, a thermal zone type or a file path */
+static int cbc_predictor_init(struct cbc_th_predictor *p)
+{
+	char path[64], type[TH_NAME_MAX];
+	struct cbc_th_io *io = io_lookup(NULL, p->name);
+	FILE *file;
 	int i;
+
+	if (io && io->read == cbc_signal_read) {
+		p->sig = io->data;
+		return 0;
+	}
+	if (p->name[0] == '/') {
+		p->fd = open(p->name, O_RDONLY);
+		return p->fd < 0 ? -1 : 0;
+	}
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path), TH_THERMAL_ZONE "%d/type", i);
+		file = fopen(path, "r");
+		if (!file)
+			return -1;
+		if (fscanf(file, "%63s", type) == 1 && strcmp(type, p->name) == 0) {
+			fclose(file);
+			snprintf(path, sizeof(path), TH_THERMAL_ZONE "%d/temp", i);
+			p->fd = open(path, O_RDONLY);
+			return p->fd < 0 ? -1 : 0;
+		}
+		fclose(file);
+	}
+}
+
+static void cbc_cool_init(struct cbc_th_cool *cool)
+{
+	char buf[TH_IOBUF_MAX];
+	int len;
+
+	if (strcmp(cool->rapl, "none") == 0 || !cool->rapl_steps)
+		goto fan_only;
+	cool->rapl_fd = open(cool->rapl, O_RDWR);
+	if (cool->rapl_fd < 0)
+		goto fan_only;
+	len = pread(cool->rapl_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		close(cool->rapl_fd);
+		cool->rapl_fd = -1;
+		goto fan_only;
+	}
+	buf[len] = 0;
+	cool->rapl_orig = cool->rapl_val = atol(buf);
+	snprintf(cool->rapl_orig_buf, sizeof(cool->rapl_orig_buf), "%ld", cool->rapl_orig);
+	if (cool == &cbc_cool0)
+		atexit(cbc_cool_restore_exit);
+	pr_log("%s: %d fan + %d rapl states, %s=%ld\n", cool->name, cool->fan_steps,
+		cool->rapl_steps, cool->rapl, cool->rapl_orig);
+	return;
+fan_only:
+	pr_log("%s: %d fan states, no rapl\n", cool->name, cool->fan_steps);
+}
+
+static void cbc_th_io_init(const char *conf)
+{
+	static char predict_name[TH_NAME_MAX + sizeof("_predict")];
+	struct cbc_th_signal *s;
+	struct cbc_th_cdev *cdev;
 	struct cbc_th_io *io;
+	int i;
+
+	if (conf) {
+		ASSERT(cbc_th_conf_load(conf) == 0, "cannot open config %s\n", conf);
+	} else if (cbc_th_conf_load(TH_CONF_FILE) != 0 &&
+			cbc_th_conf_load(TH_CONF_DEFAULT_FILE) != 0) {
+		pr_log("no config found, use default signal map\n");
+		for (i = 0; i < sizeof(cbc_th_signals_default)/sizeof(cbc_th_signals_default[0]); i++)
+			cbc_signal_add(&cbc_th_signals_default[i]);
+	}
+	/* after the whole config is loaded, history_len may come late */
+	if (cbc_th_history_len)
+		SIG_FOREACH(i, s)
+			cbc_history_init(s);
+	SIG_FOREACH(i, s) {
+		io = io_add(io_register_dir(NULL, TH_RAW_DIR), s->name);
+		if (io) {
+			io->read = cbc_signal_raw_read;
+			io->data = s;
+		}
+	}
+	for (i = 0; i < cbc_th_filters_num; i++) {
+		struct cbc_th_filter *f = &cbc_th_filters[i];
 
-	IO_FOREACH(i, io) {
-		if(strcmp(path + 1, io->name) == 0) {
-			if (io->write)
-				io->write((char *)buf, size, io->data);
-			else
-				pr_log("%s: invalid write: %s\n", io->name, buf);
+		io = io_lookup(NULL, f->name);
+		if (!io || io->read != cbc_signal_read) {
+			pr_log("filter sensor %s not found\n", f->name);
+			continue;
+		}
+		s = io->data;
+		s->filter = f;
+		if (f->stale_ms)
+			cbc_th_stale_check = 1;
+	}
+	for (i = 0; i < IO_STATICS_NUM; i++)
+		io_register(io_statics[i].name, io_statics[i].read,
+			io_statics[i].write, io_statics[i].data);
+	io_register_dump(NULL, "stats", cbc_stats_dump, NULL);
+	if (!cbc_th_cdevs_num)
+		cbc_th_cdevs[cbc_th_cdevs_num++] = cbc_th_cdev_default;
+	CDEV_FOREACH(i, cdev)
+		cbc_cdev_init(cdev);
+	cbc_cool_init(&cbc_cool0);
+	io_register_dump(NULL, "cbc_cool0_info", cbc_cool_info_dump, &cbc_cool0);
+
+	for (i = 0; i < cbc_th_predictors_num; ) {
+		if (cbc_predictor_init(&cbc_th_predictors[i]) == 0) {
+			pr_log("predict %s trip %d\n", cbc_th_predictors[i].name, cbc_th_predictors[i].trip);
+			i++;
+			continue;
+		}
+		pr_log("predictor sensor %s not found\n", cbc_th_predictors[i].name);
+		memmove(&cbc_th_predictors[i], &cbc_th_predictors[i + 1],
+			(--cbc_th_predictors_num - i) * sizeof(cbc_th_predictors[0]));
+	}
+	if (cbc_th_predictors_num) {
+		snprintf(predict_name, sizeof(predict_name), "%s_predict", cbc_th_cdevs[0].name);
+		io = io_register_dump(NULL, predict_name, cbc_predict_dump, NULL);
+		if (io)
+			io->write = cbc_predict_write;
+	}
+}
+
+static void cbc_shm_entry_init(struct cbc_th_shm_entry *e, const char *name,
+				uint32_t flags, int val)
+{
+	strncpy(e->name, name, sizeof(e->name) - 1);
+	e->flags = flags;
+	e->value = val;
+	e->ts_ns = cbc_th_now();
+}
+
+/* LEB128 varint of the trace format, see cbc_thermal.h */
+static uint8_t *cbc_trace_uvarint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* a full or read-only disk only stops the trace */
+static int cbc_trace_write(const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(cbc_th_trace_fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_log("trace: write error %d\n", errno);
+			close(cbc_th_trace_fd);
+			cbc_th_trace_fd = -1;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* trace parts in the trace directory */
+static int cbc_trace_filter(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+
+	return len > 4 && strcmp(d->d_name + len - 4, ".ctt") == 0;
+}
+
+/* delete the oldest trace files until the total size fits trace_max_kb */
+static void cbc_trace_retention(void)
+{
+	char path[TH_PATH_MAX * 2], current[TH_NAME_MAX];
+	struct dirent **files;
+	struct stat *st;
+	off_t total = 0;
+	int i, n, oldest;
+
+	n = scandir(cbc_th_trace_dir, &files, cbc_trace_filter, alphasort);
+	if (n < 0)
+		return;
+	snprintf(current, sizeof(current), "%s.%d.ctt", cbc_th_trace_boot_id, cbc_th_trace_part);
+	st = calloc(n, sizeof(*st));
+	for (i = 0; st && i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%.64s", cbc_th_trace_dir, files[i]->d_name);
+		if (stat(path, &st[i]) == 0)
+			total += st[i].st_size;
+	}
+	while (st && total > (off_t)cbc_th_trace_max * 1024) {
+		oldest = -1;
+		for (i = 0; i < n; i++) {
+			/* the part being written is never removed */
+			if (!files[i] || strcmp(files[i]->d_name, current) == 0)
+				continue;
+			if (oldest < 0 || st[i].st_mtime < st[oldest].st_mtime)
+				oldest = i;
+		}
+		if (oldest < 0)
 			break;
+		snprintf(path, sizeof(path), "%s/%.64s", cbc_th_trace_dir, files[oldest]->d_name);
+		if (unlink(path) == 0)
+			pr_log("trace: remove %s\n", path);
+		total -= st[oldest].st_size;
+		free(files[oldest]);
+		files[oldest] = NULL;
+	}
+	for (i = 0; i < n; i++)
+		free(files[i]);
+	free(files);
+	free(st);
+}
+
+/* start the next part of this boot's segment, called with the write lock held */
+static int cbc_trace_open(void)
+{
+	struct cbc_th_trace_header header = {
+		.magic = CBC_TH_TRACE_MAGIC,
+		.version = CBC_TH_TRACE_VERSION,
+		.count = cbc_th_signals_num + cbc_th_cdevs_num,
+	};
+	struct cbc_th_trace_signal sig;
+	char path[TH_PATH_MAX * 2];
+	struct timespec ts;
+	int i;
+
+	if (cbc_th_trace_fd >= 0) {
+		close(cbc_th_trace_fd);
+		cbc_th_trace_part++;
+	}
+	snprintf(path, sizeof(path), "%s/%s.%d.ctt", cbc_th_trace_dir, cbc_th_trace_boot_id,
+		cbc_th_trace_part);
+	cbc_th_trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cbc_th_trace_fd < 0) {
+		pr_log("trace: open %s error %d\n", path, errno);
+		return -1;
+	}
+	memcpy(header.boot_id, cbc_th_trace_boot_id, sizeof(header.boot_id));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.monotonic_ns = cbc_th_now();
+	header.realtime_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	if (cbc_trace_write(&header, sizeof(header)) < 0)
+		return -1;
+	for (i = 0; i < cbc_th_signals_num + cbc_th_cdevs_num; i++) {
+		memset(&sig, 0, sizeof(sig));
+		strncpy(sig.name, i < cbc_th_signals_num ? cbc_th_signals[i].name :
+			cbc_th_cdevs[i - cbc_th_signals_num].name,
+			sizeof(sig.name) - 1);
+		if (cbc_trace_write(&sig, sizeof(sig)) < 0)
+			return -1;
+	}
+	cbc_th_trace_size = sizeof(header) + sizeof(sig) * (cbc_th_signals_num + cbc_th_cdevs_num);
+	/* values restart from 0 at the sync record of each part */
+	cbc_th_trace_ts = 0;
+	memset(cbc_th_trace_vals, 0, sizeof(*cbc_th_trace_vals) * (cbc_th_signals_num + cbc_th_cdevs_num));
+	pr_log("trace: write %s\n", path);
+	cbc_trace_retention();
+	return 0;
+}
+
+/* encode the queued samples and append them in one write */
+static void cbc_trace_flush(void)
+{
+	static struct cbc_th_trace_rec recs[TH_TRACE_RING];
+	static uint8_t buf[TH_TRACE_RING * 24 + 16];
+	struct cbc_th_trace_rec *r;
+	unsigned int i, n, dropped;
+	uint8_t *p = buf;
+	int64_t dv;
+
+	pthread_mutex_lock(&cbc_th_trace_write_lock);
+	pthread_mutex_lock(&cbc_th_trace_lock);
+	for (n = 0; cbc_th_trace_tail != cbc_th_trace_head; n++)
+		recs[n] = cbc_th_trace_ring[cbc_th_trace_tail++ % TH_TRACE_RING];
+	dropped = cbc_th_trace_dropped;
+	cbc_th_trace_dropped = 0;
+	pthread_mutex_unlock(&cbc_th_trace_lock);
+
+	if (dropped)
+		pr_log("trace: %u samples dropped\n", dropped);
+	if (cbc_th_trace_fd < 0 || !n)
+		goto out;
+	for (i = 0, r = recs; i < n; i++, r++) {
+		/* sync on a new part and if samples of two threads crossed */
+		if (!cbc_th_trace_ts || r->ts / 1000 < cbc_th_trace_ts) {
+			cbc_th_trace_ts = r->ts / 1000;
+			*p++ = 0;
+			p = cbc_trace_uvarint(p, cbc_th_trace_ts);
+			memset(cbc_th_trace_vals, 0, sizeof(*cbc_th_trace_vals) * (cbc_th_signals_num + cbc_th_cdevs_num));
 		}
+		p = cbc_trace_uvarint(p, r->idx + 1);
+		p = cbc_trace_uvarint(p, r->ts / 1000 - cbc_th_trace_ts);
+		dv = (int64_t)r->val - cbc_th_trace_vals[r->idx];
+		p = cbc_trace_uvarint(p, ((uint64_t)dv << 1) ^ (uint64_t)(dv >> 63));
+		cbc_th_trace_ts = r->ts / 1000;
+		cbc_th_trace_vals[r->idx] = r->val;
 	}
-	return size;
+	if (cbc_trace_write(buf, p - buf) < 0)
+		goto out;
+	cbc_th_trace_size += p - buf;
+	if (cbc_th_trace_size >= (off_t)cbc_th_trace_max * 1024 / TH_TRACE_PARTS)
+		cbc_trace_open();
+out:
+	pthread_mutex_unlock(&cbc_th_trace_write_lock);
 }
 
-static int io_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
+/* flush the queued samples every trace_flush_ms */
+static void *cbc_trace_thread(void *arg)
 {
-	int len = 0;
+	struct timespec ts;
+
+	while (1) {
+		ts.tv_sec = cbc_th_trace_flush / 1000;
+		ts.tv_nsec = (cbc_th_trace_flush % 1000) * 1000000l;
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+		cbc_trace_flush();
+	}
+	return NULL;
+}
+
+/* first part of this boot follows the parts of a previous cbc_thermal run */
+static void cbc_trace_init(void)
+{
+	struct dirent **files;
+	size_t len;
+	int i, n, fd;
+
+	if (!cbc_th_trace_max)
+		return;
+	fd = open(TH_TRACE_BOOT_ID, O_RDONLY);
+	if (fd < 0 || read(fd, cbc_th_trace_boot_id, sizeof(cbc_th_trace_boot_id) - 1) <= 0) {
+		pr_log("trace: read %s error\n", TH_TRACE_BOOT_ID);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	close(fd);
+	cbc_th_trace_boot_id[strcspn(cbc_th_trace_boot_id, "\n")] = 0;
+	len = strlen(cbc_th_trace_boot_id);
+
+	if (mkdir(cbc_th_trace_dir, 0755) < 0 && errno != EEXIST) {
+		pr_log("trace: mkdir %s error %d\n", cbc_th_trace_dir, errno);
+		return;
+	}
+	n = scandir(cbc_th_trace_dir, &files, cbc_trace_filter, NULL);
+	for (i = 0; i < n; i++) {
+		if (strncmp(files[i]->d_name, cbc_th_trace_boot_id, len) == 0 &&
+		    files[i]->d_name[len] == '.' && atoi(files[i]->d_name + len + 1) >= cbc_th_trace_part)
+			cbc_th_trace_part = atoi(files[i]->d_name + len + 1) + 1;
+		free(files[i]);
+	}
+	if (n >= 0)
+		free(files);
+
+	cbc_th_trace_vals = calloc(cbc_th_signals_num + cbc_th_cdevs_num, sizeof(*cbc_th_trace_vals));
+	cbc_th_trace_ring = calloc(TH_TRACE_RING, sizeof(*cbc_th_trace_ring));
+	ASSERT(cbc_th_trace_vals && cbc_th_trace_ring, "trace: out of memory\n");
+	pthread_mutex_lock(&cbc_th_trace_write_lock);
+	cbc_trace_open();
+	pthread_mutex_unlock(&cbc_th_trace_write_lock);
+}
+
+/*
+ * Publish all sensors and cooling devices in CBC_TH_SHM_NAME, see cbc_thermal_shm.h.
+ * The object is reused if it exists, so readers which mapped it before a
+ * restart keep a valid mapping and see the generation change.
+ */
+static void cbc_shm_init(void)
+{
+	struct cbc_th_shm *shm;
+	struct cbc_th_signal *s;
+	struct cbc_th_cdev *cdev;
+	uint32_t gen = 0;
+	int fd, i;
+
+	if (cbc_th_signals_num + cbc_th_cdevs_num > CBC_TH_SHM_ENTRY_MAX) {
+		pr_log("too many sensors for shared memory\n");
+		return;
+	}
+	fd = shm_open(CBC_TH_SHM_NAME, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		pr_log("shm_open %s error %d\n", CBC_TH_SHM_NAME, errno);
+		return;
+	}
+	/* shm_open honours umask, readers only need read access */
+	if (fchmod(fd, 0644) < 0 || ftruncate(fd, CBC_TH_SHM_SIZE) < 0) {
+		pr_log("setup %s error %d\n", CBC_TH_SHM_NAME, errno);
+		close(fd);
+		return;
+	}
+	shm = mmap(NULL, CBC_TH_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		pr_log("mmap %s error %d\n", CBC_TH_SHM_NAME, errno);
+		return;
+	}
+	if (shm->magic == CBC_TH_SHM_MAGIC)
+		gen = shm->generation + 1;
+
+	/* keep the seqlock odd while the whole table is rebuilt */
+	__atomic_store_n(&shm->seq, shm->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(shm->entries, 0, CBC_TH_SHM_SIZE - sizeof(*shm));
+	SIG_FOREACH(i, s)
+		cbc_shm_entry_init(&shm->entries[i], s->name, CBC_TH_SHM_SENSOR, s->val);
+	CDEV_FOREACH(i, cdev)
+		cbc_shm_entry_init(&shm->entries[cbc_th_signals_num + i], cdev->name,
+			CBC_TH_SHM_COOLING, cdev->val);
+	shm->count = cbc_th_signals_num + cbc_th_cdevs_num;
+	shm->generation = gen;
+	shm->entry_size = sizeof(struct cbc_th_shm_entry);
+	shm->version = CBC_TH_SHM_VERSION;
+	shm->magic = CBC_TH_SHM_MAGIC;
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+	cbc_th_shm = shm;
+	pr_log("publish %d entries in /dev/shm%s\n", shm->count, CBC_TH_SHM_NAME);
+}
+
+static void io_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	struct cbc_th_io *io = ino_io(ino);
+	char buf[TH_IOBUF_MAX], *dump;
+	size_t dump_len = 0;
+	int len;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = ino;
+	if (!io || io->is_dir) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = io->write ? S_IFREG | 0644 : S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		if (io->dump) {
+			/* size of the snapshot an open would take now */
+			dump = io->dump(&dump_len, io->data);
+			free(dump);
+			stbuf->st_size = dump ? dump_len : 0;
+			return;
+		}
+		/* size of the current value, reads are direct_io anyway */
+		len = io->read ? io->read(buf, sizeof(buf), io->data) : 0;
+		if (len > (int)sizeof(buf) - 1)
+			len = sizeof(buf) - 1;
+		stbuf->st_size = len > 0 ? len : 0;
+	}
+}
+
+/* return 1 if ino is a directory, *dir is its io (NULL for the root) */
+static int ino_dir(fuse_ino_t ino, struct cbc_th_io **dir)
+{
+	struct cbc_th_io *io = ino_io(ino);
+
+	*dir = io;
+	return ino == FUSE_ROOT_ID || (io && io->is_dir);
+}
+
+static void io_lookup_ll(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	struct cbc_th_io *dir, *io;
+
+	if (!ino_dir(parent, &dir) || !(io = io_lookup(dir, name))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	e.ino = IO_INO(io);
+	e.attr_timeout = TH_ATTR_TIMEOUT;
+	e.entry_timeout = TH_ENTRY_TIMEOUT;
+	io_stat(e.ino, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void io_getattr_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+
+	if (ino != FUSE_ROOT_ID && !ino_io(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	io_stat(ino, &stbuf);
+	fuse_reply_attr(req, &stbuf, TH_ATTR_TIMEOUT);
+}
+
+/* only truncate is expected here, e.g. "echo > file", nothing to do */
+static void io_setattr_ll(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			int to_set, struct fuse_file_info *fi)
+{
+	io_getattr_ll(req, ino, fi);
+}
+
+static void dirbuf_add(fuse_req_t req, struct dirbuf *b, const char *name,
+			fuse_ino_t ino, mode_t mode)
+{
+	struct stat stbuf;
+	size_t oldsize = b->size;
+
+	b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	b->p = realloc(b->p, b->size);
+	ASSERT(b->p, "alloc dirbuf error\n");
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = ino;
+	stbuf.st_mode = mode;
+	fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, &stbuf, b->size);
+}
+
+static void io_readdir_ll(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi)
+{
+	static pthread_mutex_t dirbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+	static struct dirbuf root;
+	struct dirbuf *b;
+	struct cbc_th_io *dir, *io;
 	int i;
-	struct cbc_th_io *io;
 
-	buf[0] = 0;
-	IO_FOREACH(i, io) {
-		if(strcmp(path + 1, io->name) == 0) {
-			if (offset == 0 && io->read)
-				len = io->read(buf, size, io->data);
+	if (!ino_dir(ino, &dir)) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	b = dir ? &dir->dir : &root;
+	/* the tree never changes, build the directory stream once */
+	pthread_mutex_lock(&dirbuf_lock);
+	if (!b->p) {
+		dirbuf_add(req, b, ".", ino, S_IFDIR);
+		dirbuf_add(req, b, "..", dir && dir->parent ? IO_INO(dir->parent) : FUSE_ROOT_ID, S_IFDIR);
+		IO_FOREACH(i, io) {
+			if (io->parent == dir)
+				dirbuf_add(req, b, io->name, IO_INO(io),
+					io->is_dir ? S_IFDIR : S_IFREG);
+		}
+	}
+	pthread_mutex_unlock(&dirbuf_lock);
+
+	if (off < b->size)
+		fuse_reply_buf(req, b->p + off, b->size - off < size ? b->size - off : size);
+	else
+		fuse_reply_buf(req, NULL, 0);
+}
+
+static void io_release_fh(struct cbc_th_fh *fh)
+{
+	struct cbc_th_fh **p;
+
+	pthread_mutex_lock(&cbc_th_poll_lock);
+	for (p = &fh->io->fhs; *p; p = &(*p)->next) {
+		if (*p == fh) {
+			*p = fh->next;
 			break;
 		}
 	}
-	return len;
+	if (fh->ph)
+		fuse_pollhandle_destroy(fh->ph);
+	pthread_mutex_unlock(&cbc_th_poll_lock);
+	free(fh->buf);
+	free(fh);
+}
+
+static void io_open_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct cbc_th_io *io = ino_io(ino);
+	struct cbc_th_fh *fh;
+
+	if (!io || io->is_dir) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	fh = calloc(1, sizeof(*fh));
+	if (fh && io->dump) {
+		fh->buf = io->dump(&fh->len, io->data);
+		if (!fh->buf) {
+			free(fh);
+			fh = NULL;
+		}
+	}
+	if (!fh) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	pthread_mutex_lock(&cbc_th_poll_lock);
+	fh->io = io;
+	fh->gen = io->gen;
+	fh->next = io->fhs;
+	io->fhs = fh;
+	pthread_mutex_unlock(&cbc_th_poll_lock);
+	fi->fh = (uintptr_t)fh;
+	/* values change all the time, never use the page cache */
+	fi->direct_io = 1;
+	fi->keep_cache = 0;
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		/* open was interrupted, release will not come */
+		io_release_fh(fh);
+}
+
+static void io_release_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	io_release_fh((struct cbc_th_fh *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
 }
 
-static struct fuse_operations cbc_thermal_fsops = {
-	.getattr	= io_getattr,
-	.readdir	= io_readdir,
-	.read		= io_read,
-	.write		= io_write,
-        .truncate	= io_truncate,
+/* readable once the value changed since the last read of this file */
+static void io_poll_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+			struct fuse_pollhandle *ph)
+{
+	struct cbc_th_fh *fh = (struct cbc_th_fh *)(uintptr_t)fi->fh;
+	unsigned int revents = POLLOUT;
+
+	pthread_mutex_lock(&cbc_th_poll_lock);
+	if (fh->gen != fh->io->gen)
+		revents |= POLLIN | POLLPRI;
+	if (ph) {
+		if (fh->ph)
+			fuse_pollhandle_destroy(fh->ph);
+		fh->ph = ph;
+	}
+	pthread_mutex_unlock(&cbc_th_poll_lock);
+	fuse_reply_poll(req, revents);
+}
+
+static void io_read_ll(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi)
+{
+	struct cbc_th_io *io = ino_io(ino);
+	struct cbc_th_fh *fh = (struct cbc_th_fh *)(uintptr_t)fi->fh;
+	char buf[TH_IOBUF_MAX];
+	int len = 0;
+
+	if (fh->buf) {
+		/* snapshot taken on open */
+		if (off < fh->len)
+			fuse_reply_buf(req, fh->buf + off, fh->len - off < size ? fh->len - off : size);
+		else
+			fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	/* a poll after this read blocks until the next change */
+	if (off == 0)
+		fh->gen = io->gen;
+	if (io->read)
+		len = io->read(buf, sizeof(buf), io->data);
+	if (len > (int)sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
+	if (len > 0 && off < len)
+		fuse_reply_buf(req, buf + off, len - off < size ? len - off : size);
+	else
+		fuse_reply_buf(req, NULL, 0);
+}
+
+static void io_write_ll(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct cbc_th_io *io = ino_io(ino);
+	char val[TH_IOBUF_MAX];
+	size_t len = size < sizeof(val) - 1 ? size : sizeof(val) - 1;
+
+	/* the kernel buffer is not null terminated */
+	memcpy(val, buf, len);
+	val[len] = 0;
+	if (io && io->write)
+		io->write(val, len, io->data);
+	else
+		pr_log("%s: invalid write: %s\n", io ? io->name : "?", val);
+	fuse_reply_write(req, size);
+}
+
+static struct fuse_lowlevel_ops cbc_thermal_llops = {
+	.lookup		= io_lookup_ll,
+	.getattr	= io_getattr_ll,
+	.setattr	= io_setattr_ll,
+	.readdir	= io_readdir_ll,
+	.open		= io_open_ll,
+	.release	= io_release_ll,
+	.read		= io_read_ll,
+	.write		= io_write_ll,
+	.poll		= io_poll_ll,
 };
 
-int main(void)
+static int cbc_th_fuse_loop(void)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	int err = -1;
+
+	if (fuse_opt_add_arg(&args, "cbc_thermal") != 0 ||
+	    fuse_opt_add_arg(&args, "-o") != 0 ||
+	    fuse_opt_add_arg(&args, "nonempty,allow_other,default_permissions") != 0)
+		ASSERT(0, "fuse args error\n");
+
+	ch = fuse_mount(cbc_th_io_dir, &args);
+	ASSERT(ch, "mount %s error\n", cbc_th_io_dir);
+	se = fuse_lowlevel_new(&args, &cbc_thermal_llops, sizeof(cbc_thermal_llops), NULL);
+	if (se) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			fuse_session_add_chan(se, ch);
+			err = fuse_session_loop_mt(se);
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(cbc_th_io_dir, ch);
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
+
+int main(int argc, char **argv)
 {
 	pthread_t pthread;
 	pthread_attr_t attr;
-        char *fake_argv[10];
+	pthread_condattr_t cond_attr;
+	const char *conf = NULL;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "c:s:d:m:")) != -1) {
+		switch (c) {
+		case 'c':
+			conf = optarg;
+			break;
+		case 's':
+			cbc_th_signals_dev = optarg;
+			break;
+		case 'd':
+			cbc_th_diagnosis_dev = optarg;
+			break;
+		case 'm':
+			cbc_th_io_dir = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c config] [-s signals device] [-d diagnosis device] [-m mountpoint]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	cbc_th_io_init(conf);
+	signal(SIGTERM, cbc_cool_signal);
+	signal(SIGINT, cbc_cool_signal);
+	signal(SIGHUP, cbc_cool_signal);
+	cbc_shm_init();
+	cbc_trace_init();
 
 	pr_log("wait for cbc device ...\n");
 	while (1) {
-		if (access("/dev/cbc-diagnosis", F_OK) == 0 && access("/dev/cbc-signals", F_OK) == 0)
+		if (access(cbc_th_diagnosis_dev, F_OK) == 0 && access(cbc_th_signals_dev, F_OK) == 0)
 			break;
 		sleep(1);
 	}
 
-	pr_log("open cbc-diagnosis ...\n");
-	cbc_diagnosis_fd = open("/dev/cbc-diagnosis", O_RDWR | O_NOCTTY);
-	ASSERT(cbc_diagnosis_fd > 0, "open /dev/cbc-diagnosis error\n");
+	pr_log("open %s ...\n", cbc_th_diagnosis_dev);
+	cbc_diagnosis_fd = open(cbc_th_diagnosis_dev, O_RDWR | O_NOCTTY);
+	ASSERT(cbc_diagnosis_fd > 0, "open %s error\n", cbc_th_diagnosis_dev);
 
-	pr_log("open cbc-signals ...\n");
-	cbc_signals_fd = open("/dev/cbc-signals", O_RDWR | O_NOCTTY);
-	ASSERT(cbc_signals_fd > 0, "open /dev/cbc-signals error\n");
+	pr_log("open %s ...\n", cbc_th_signals_dev);
+	cbc_signals_fd = open(cbc_th_signals_dev, O_RDWR | O_NOCTTY);
+	ASSERT(cbc_signals_fd > 0, "open %s error\n", cbc_th_signals_dev);
 
 	signal(SIGPIPE, SIG_IGN);
 
 	pthread_mutex_init(&cbc_th_io_lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cbc_th_cdev_cond, &cond_attr);
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&pthread, (const pthread_attr_t *)&attr, cbc_cdev_thread, NULL) != 0)
+		ASSERT(0, "create cbc cooling device thread error\n");
+	if (cbc_th_trace_ring &&
+	    pthread_create(&pthread, (const pthread_attr_t *)&attr, cbc_trace_thread, NULL) != 0)
+		ASSERT(0, "create cbc trace thread error\n");
+	if (cbc_th_predictors_num &&
+	    pthread_create(&pthread, (const pthread_attr_t *)&attr, cbc_predict_thread, NULL) != 0)
+		ASSERT(0, "create cbc predict thread error\n");
 	if (pthread_create(&pthread, (const pthread_attr_t *)&attr, cbc_read_thread, NULL) != 0)
 		ASSERT(0, "create cbc thermal thread error\n");
 
@@ -378,16 +2371,15 @@ int main(void)
 		sleep(1);
 
 	pr_log("mount cbc thermal io ...\n");
-	if (system("mkdir -p " TH_IO_DIR) != 0)
-		ASSERT(0, "mkdir -p "TH_IO_DIR " error!!!\n");
-        fake_argv[0] = "cbc_thermal";
-        fake_argv[1] = "-f";
-        fake_argv[2] = "-o";
-        fake_argv[3] = "nonempty";
-        fake_argv[4] = "-o";
-        fake_argv[5] = "allow_other";
-        fake_argv[6] = "-o";
-        fake_argv[7] = "default_permissions";
-        fake_argv[8] = TH_IO_DIR;
-        return fuse_main(9, fake_argv, &cbc_thermal_fsops, NULL);
+	if (mkdir(cbc_th_io_dir, 0755) < 0 && errno != EEXIST)
+		ASSERT(0, "mkdir %s error!!!\n", cbc_th_io_dir);
+	/* fuse only installs its handlers over SIG_DFL, they end the loop */
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	ret = cbc_th_fuse_loop();
+	cbc_cool_restore(&cbc_cool0);
+	if (cbc_th_trace_ring)
+		cbc_trace_flush();
+	return ret;
 }
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * SPDX-License-identifier: BSD-3-Clause
+ */
+
+/*
+ * Binary formats exported by cbc_thermal in /run/cbc_thermal.
+ *
+ * /run/cbc_thermal/history/<sensor> is one struct cbc_th_history_header
+ * followed by header.count struct cbc_th_history_sample, oldest first.
+ * All fields are little endian. /run/cbc_thermal/history/<sensor>.txt
+ * holds the same samples as "<seconds>.<nanoseconds> <value>" lines.
+ *
+ * cbc_thermal_sampler logs are one struct cbc_th_sample_header, then
+ * header.columns struct cbc_th_sample_column, then records of
+ * header.record_size bytes: a uint64_t CLOCK_REALTIME timestamp in ns
+ * followed by one int64_t value per column (int32_t in version 1 logs).
+ *
+ * Trace files <boot_id>.<part>.ctt written by cbc_thermal are one
+ * struct cbc_th_trace_header, header.count struct cbc_th_trace_signal,
+ * then a stream of records made of LEB128 varints:
+ *	0, <ts_us>			sync: absolute CLOCK_MONOTONIC, resets
+ *					all values to 0
+ *	<index + 1>, <dt_us>, <dv>	signal <index> sampled dt_us after the
+ *					previous record, its value changed by
+ *					dv (zigzag encoded) since its last record
+ * A record cut at the end of the file is ignored.
+ */
+
+#ifndef CBC_THERMAL_H
+#define CBC_THERMAL_H
+
+#include <stdint.h>
+
+#define CBC_TH_HISTORY_MAGIC	0x48485443	/* "CTHH" */
+#define CBC_TH_HISTORY_VERSION	1
+
+struct cbc_th_history_header {
+	uint32_t magic;		/* CBC_TH_HISTORY_MAGIC */
+	uint16_t version;	/* CBC_TH_HISTORY_VERSION */
+	uint16_t sample_size;	/* sizeof(struct cbc_th_history_sample) */
+	uint32_t count;		/* number of samples following the header */
+	uint32_t capacity;	/* ring size, count stops growing here */
+} __attribute__((packed));
+
+struct cbc_th_history_sample {
+	uint64_t ts_ns;		/* CLOCK_MONOTONIC of the signal frame */
+	int32_t value;		/* published value, same as /run/cbc_thermal/<sensor> */
+} __attribute__((packed));
+
+#define CBC_TH_SAMPLE_MAGIC	0x4c485443	/* "CTHL" */
+#define CBC_TH_SAMPLE_VERSION	2
+#define CBC_TH_SAMPLE_NAME_MAX	48
+
+struct cbc_th_sample_header {
+	uint32_t magic;		/* CBC_TH_SAMPLE_MAGIC */
+	uint16_t version;	/* CBC_TH_SAMPLE_VERSION */
+	uint16_t columns;	/* number of struct cbc_th_sample_column */
+	uint32_t interval_us;	/* sampling interval */
+	uint32_t record_size;	/* 8 + 8 * columns */
+} __attribute__((packed));
+
+struct cbc_th_sample_column {
+	char name[CBC_TH_SAMPLE_NAME_MAX];	/* CSV column title */
+	uint8_t decimals;	/* values are scaled by 10^decimals */
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+#define CBC_TH_TRACE_MAGIC	0x54485443	/* "CTHT" */
+#define CBC_TH_TRACE_VERSION	1
+#define CBC_TH_TRACE_NAME_MAX	32
+
+struct cbc_th_trace_header {
+	uint32_t magic;		/* CBC_TH_TRACE_MAGIC */
+	uint16_t version;	/* CBC_TH_TRACE_VERSION */
+	uint16_t count;		/* number of struct cbc_th_trace_signal */
+	char boot_id[40];	/* /proc/sys/kernel/random/boot_id */
+	uint64_t realtime_ns;	/* CLOCK_REALTIME at monotonic_ns */
+	uint64_t monotonic_ns;
+} __attribute__((packed));
+
+struct cbc_th_trace_signal {
+	char name[CBC_TH_TRACE_NAME_MAX];	/* sensor or cooling device */
+} __attribute__((packed));
+
+#endif /* CBC_THERMAL_H */
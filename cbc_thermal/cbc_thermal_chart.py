@@ -16,6 +16,8 @@ import re
 import xml.etree.ElementTree as etree
 import threading
 import mmap
+import subprocess
+import struct
 
 thermal_sensors = []
 thermal_cdevs = []
@@ -123,6 +125,10 @@ def gen_svg_header(width, height):
       rect.limit   { fill: rgb(255,255,0); stroke-width: 0; fill-opacity: 0.7; }
       rect.busy  { fill: rgb(64,64,240); stroke-width: 0; fill-opacity: 0.7; }
       rect.temp    { fill: rgb(192,64,64); stroke-width: 0; fill-opacity: 0.7; }
+      polygon.cooling { fill: rgb(64,200,64); stroke-width: 0; fill-opacity: 0.7; }
+      polygon.limit { fill: rgb(255,255,0); stroke-width: 0; fill-opacity: 0.7; }
+      polygon.busy { fill: rgb(64,64,240); stroke-width: 0; fill-opacity: 0.7; }
+      polygon.temp { fill: rgb(192,64,64); stroke-width: 0; fill-opacity: 0.7; }
       line       { stroke: rgb(64,64,64); stroke-width: 1; }
       line.sec10  { stroke-width: 2; }
       line.sec01 { stroke: rgb(224,224,224); stroke-width: 1; }
@@ -183,6 +189,146 @@ def gen_svg_graph(y, color, title, data, max_val, min_val):
     y = y + 160
     return y, body
 
+def gen_svg_polygon(y, color, title, points, max_val, min_val, width, ts_start, ts_end):
+    body = '<g transform="translate(10,{0})">\n'.format(y)
+    body += '<rect class="box" x="0.000" y="0" width="{0}" height="100.000" />\n'.format(width)
+    body += '<text class="t2" x="8" y="-20">{0}</text>\n'.format(title)
+    body += '<text class="t3" x="4" y="20">{0}</text>\n'.format(max_val)
+    body += '<text class="t3" x="4" y="100">{0}</text>\n'.format(min_val)
+    scale = 100 / (max_val - min_val + 0.01)
+    duration = max(ts_end - ts_start, 0.001)
+    # about 20 grid lines whatever the recording length
+    step = 10
+    for step in [10, 30, 60, 300, 600, 1800, 3600, 7200, 21600, 43200, 86400]:
+        if duration / step <= 20:
+            break
+    sec = 0
+    while sec <= duration:
+        x = sec * width / duration
+        body += '<line class="sec10" x1="{0:.1f}" y1="0" x2="{0:.1f}" y2="100.000"/><text class="sec" x="{0:.1f}" y="-5.000" >{1}</text>\n'.format(x, sec)
+        sec += step
+    line = '0.0,100.0'
+    for ts, val in points:
+        val = min(max(val, min_val), max_val)
+        line += ' {0:.1f},{1:.1f}'.format((ts - ts_start) * width / duration, 100 - (val - min_val) * scale)
+    line += ' {0:.1f},100.0'.format(width)
+    body += '<polygon class="{0}" points="{1}" />\n'.format(color, line)
+    body += '</g>\n\n'
+    y = y + 160
+    return y, body
+
+class sample_reader:
+    """CSV or cbc_thermal_sampler log, rows() can be iterated more than once"""
+    def __init__(self, path):
+        self.path = path
+        self.binary = False
+        with open(path, 'rb') as f:
+            head = f.read(16)
+            if len(head) == 16 and struct.unpack('<I', head[:4])[0] == 0x4c485443:
+                self.binary = True
+                magic, version, columns, interval_us, self.record_size = struct.unpack('<IHHII', head)
+                self.scales = []
+                self.titles = ["ts"]
+                for i in range(columns):
+                    name, decimals = struct.unpack('<48sB3x', f.read(52))
+                    self.titles.append(name.split(b'\0')[0].decode())
+                    self.scales.append(10 ** decimals)
+                self.data_offset = f.tell()
+                # 32 bit values in version 1 logs, 64 bit since
+                self.record = struct.Struct('<Q{0}{1}'.format(columns, 'i' if version == 1 else 'q'))
+        if not self.binary:
+            with open(path) as f:
+                self.titles = f.readline().rstrip().split(',')
+    def rows(self):
+        if self.binary:
+            with open(self.path, 'rb') as f:
+                f.seek(self.data_offset)
+                while True:
+                    rec = f.read(self.record_size)
+                    if len(rec) < self.record_size:
+                        break
+                    vals = self.record.unpack(rec)
+                    yield [vals[0] / 1e9] + [float(v) / s for v, s in zip(vals[1:], self.scales)]
+        else:
+            with open(self.path) as f:
+                f.readline()
+                for line in f:
+                    vals = line.rstrip().split(',')
+                    # skip a line cut by an interrupted recording
+                    if len(vals) == len(self.titles):
+                        yield [float(x) if x else 0.0 for x in vals]
+
+def lttb_buckets(reader, max_points):
+    """first passes: samples, value range and LTTB bucket averages of every series"""
+    cols = len(reader.titles)
+    buckets = max_points - 2
+    count = 0
+    first = last = None
+    max_vals = [float("-inf")] * cols
+    for row in reader.rows():
+        count += 1
+        for i in range(cols):
+            if row[i] > max_vals[i]:
+                max_vals[i] = row[i]
+        if first is None:
+            first = row
+        last = row
+    avg = [[[0.0, 0.0, 0] for b in range(buckets)] for i in range(cols)]
+    if count > max_points:
+        index = 0
+        for row in reader.rows():
+            if 0 < index < count - 1:
+                b = (index - 1) * buckets // (count - 2)
+                for i in range(1, cols):
+                    a = avg[i][b]
+                    a[0] += row[0]
+                    a[1] += row[i]
+                    a[2] += 1
+            index += 1
+        for i in range(1, cols):
+            for a in avg[i]:
+                if a[2]:
+                    a[0] /= a[2]
+                    a[1] /= a[2]
+    return count, first, last, max_vals, avg
+
+def lttb_select(reader, count, first, last, avg, max_points):
+    """second pass: keep in each bucket the point making the largest triangle
+    with the previously kept point and the average of the next bucket"""
+    cols = len(reader.titles)
+    buckets = max_points - 2
+    points = [[(first[0], first[i])] for i in range(cols)]
+    best = [None] * cols
+    best_area = [-1.0] * cols
+    cur = 0
+    index = 0
+    for row in reader.rows():
+        if 0 < index < count - 1:
+            b = (index - 1) * buckets // (count - 2)
+            if b != cur:
+                for i in range(1, cols):
+                    if best[i]:
+                        points[i].append(best[i])
+                    best[i] = None
+                    best_area[i] = -1.0
+                cur = b
+            for i in range(1, cols):
+                ax, ay = points[i][-1]
+                if b + 1 < buckets:
+                    cx, cy = avg[i][b + 1][0], avg[i][b + 1][1]
+                else:
+                    cx, cy = last[0], last[i]
+                area = abs((ax - cx) * (row[i] - ay) - (ax - row[0]) * (cy - ay))
+                if area > best_area[i]:
+                    best_area[i] = area
+                    best[i] = (row[0], row[i])
+        index += 1
+    for i in range(1, cols):
+        if best[i]:
+            points[i].append(best[i])
+        points[i].append((last[0], last[i]))
+    return points
+
 class intel_gpu_usage_sampling(threading.Thread):
     lock = threading.Lock()
     gpu_usage = 0
@@ -332,38 +478,48 @@ def record_to_csv(file_csv, duration, interval, all_cpu):
     if gpu_sampling.is_valid():
         gpu_sampling.stop()
  
-def csv_to_svg(file_csv, file_svg, comments):
-    data_all = {}
-    title_all = file_csv.readline().rstrip().split(',')
-    for t in title_all:
-        data_all[t] = []
-    line = file_csv.readline().rstrip()
-    while line:
-        for key, data in zip(title_all, line.split(',')):
-            data_all[key].append(data)
-        line = file_csv.readline().rstrip()
-#    pp.pprint(title_all)
-#    pp.pprint(data_all)
-
-    samples_num = len(data_all["ts"])
+def record_native(path_csv, duration, interval_ms, all_cpu, config, product):
+    path_bin = os.path.splitext(path_csv)[0] + ".bin"
+    cmd = ["cbc_thermal_sampler", "-o", path_bin, "-i", str(interval_ms), "-t", str(duration), "-c", config, "-p", product]
+    if all_cpu:
+        cmd.append("-a")
+    subprocess.check_call(cmd)
+    with open(path_csv, 'w') as file_csv:
+        subprocess.check_call(["cbc_thermal_sampler", "-x", path_bin], stdout=file_csv)
+
+def csv_to_svg(path_in, file_svg, comments, max_points):
+    reader = sample_reader(path_in)
+    title_all = reader.titles
+    max_points = max(max_points, 3)
+    samples_num, first, last, max_vals, avg = lttb_buckets(reader, max_points)
+    if samples_num == 0:
+        print("{0}: no samples".format(path_in))
+        return
+
+    if samples_num <= max_points:
+        data_all = dict(zip(title_all, zip(*reader.rows())))
+        width = samples_num * 20
+    else:
+        points = dict(zip(title_all, lttb_select(reader, samples_num, first, last, avg, max_points)))
+        width = max_points
+        comments = comments + ["{0} samples downsampled to {1} points".format(samples_num, max_points)]
     titles_num = len(title_all)
     comments_num = len(comments)
-    file_svg.write(gen_svg_header(samples_num * 20 + 200, titles_num * 160 + comments_num * 20))
+    file_svg.write(gen_svg_header(width + 200, titles_num * 160 + comments_num * 20))
 
     y,body = gen_svg_comment(0, comments)
     file_svg.write(body)
 
     re_is_cpufreq = re.compile(r"^cpu[0-9]+_freq$")
     re_get_num = re.compile(r"[0-9]+")
-    for title in title_all:
+    for index, title in enumerate(title_all):
         if title == "ts":
             continue
         color = "busy"
         max_val = 100
         if title in [x["type"] for x in thermal_sensors]:
             color = "temp"
-            max_val = max(data_all[title])
-            if float(max_val) > 1000:
+            if max_vals[index] > 1000:
                 max_val = 110000
             else:
                 max_val = 110
@@ -379,7 +535,10 @@ def csv_to_svg(file_csv, file_svg, comments):
         elif re_is_cpufreq.match(title):
             i = re_get_num.search(title).group(0)
             tmp,max_val = get_cpu_freq_range(i)
-        y,body = gen_svg_graph(y, color, title, data_all[title], float(max_val), 0)
+        if samples_num <= max_points:
+            y,body = gen_svg_graph(y, color, title, data_all[title], float(max_val), 0)
+        else:
+            y,body = gen_svg_polygon(y, color, title, points[title], float(max_val), 0, width, first[0], last[0])
         file_svg.write(body)
 
     file_svg.write(gen_svg_end())
@@ -398,13 +557,22 @@ def main(args):
    # pp.pprint(thermal_rapls_uw)
    # pp.pprint(thermal_rapl_max_val)
 
+    if args.input:
+        with open("{0}/cbc_thermal_chart-{1}.svg".format(args.output_dir, date_now_str), 'w') as file_svg:
+            csv_to_svg(args.input, file_svg, ["input: {0}".format(args.input)], args.max_points)
+        return
+
     sample_start_ts = time.time()
-    with open("{0}/cbc_thermal_chart-{1}.csv".format(args.output_dir, date_now_str), 'w') as file_csv:
-        record_to_csv(file_csv, args.time, args.interval, args.cpu_all)
+    if args.native:
+        interval_ms = args.interval_ms if args.interval_ms else args.interval * 1000
+        record_native("{0}/cbc_thermal_chart-{1}.csv".format(args.output_dir, date_now_str), args.time, interval_ms, args.cpu_all, args.config, args.product)
+        args.interval = interval_ms / 1000
+    else:
+        with open("{0}/cbc_thermal_chart-{1}.csv".format(args.output_dir, date_now_str), 'w') as file_csv:
+            record_to_csv(file_csv, args.time, args.interval, args.cpu_all)
 
-    with open("{0}/cbc_thermal_chart-{1}.csv".format(args.output_dir, date_now_str), 'r') as file_csv:
-        with open("{0}/cbc_thermal_chart-{1}.svg".format(args.output_dir, date_now_str), 'w') as file_svg:
-            csv_to_svg(file_csv, file_svg, ["sample start: {0}".format(sample_start_ts), "sample interval: {0} sec".format(args.interval), "sample duration: {0} sec".format(args.time)])
+    with open("{0}/cbc_thermal_chart-{1}.svg".format(args.output_dir, date_now_str), 'w') as file_svg:
+        csv_to_svg("{0}/cbc_thermal_chart-{1}.csv".format(args.output_dir, date_now_str), file_svg, ["sample start: {0}".format(sample_start_ts), "sample interval: {0} sec".format(args.interval), "sample duration: {0} sec".format(args.time)], args.max_points)
 
 def parse_arguments(argv):
     parser = argparse.ArgumentParser()
@@ -414,6 +582,10 @@ def parse_arguments(argv):
     parser.add_argument('--config', type=str, default="/etc/ioc-cbc-tools/thermal-conf.xml", help='CBC Thermald config. [/etc/ioc-cbc-tools/thermal-conf.xml]')
     parser.add_argument('--time', type=int, default=300, help='Record time in seconds. [300]')
     parser.add_argument('--cpu-all', action='store_const', const=True, help='Poll all cpu status, default: cpu0 only')
+    parser.add_argument('--native', action='store_const', const=True, help='Record with cbc_thermal_sampler instead of python')
+    parser.add_argument('--interval-ms', type=int, default=0, help='Poll interval in ms for --native, overrides --interval')
+    parser.add_argument('--max-points', type=int, default=1000, help='Points per graph, longer recordings are downsampled. [1000]')
+    parser.add_argument('--input', type=str, help='Draw the chart of a recorded CSV or cbc_thermal_sampler log, no recording')
     return parser.parse_args(argv)
 
 if __name__ == '__main__':
@@ -0,0 +1,650 @@
+/*
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * SPDX-License-identifier: BSD-3-Clause
+ */
+
+/*
+ * Thermal policy replay harness. Two pty pairs stand in for
+ * /dev/cbc-signals and /dev/cbc-diagnosis of cbc_thermal: a recorded
+ * temperature trace is replayed as CBC signal frames at real or
+ * accelerated speed, fan commands are answered with duty reports and
+ * logged, and the reaction latency, the overshoot above a trip point
+ * and the fan duty energy are reported at the end.
+ *
+ * The trace is CSV, either "time,name,value" or the output of
+ * cbc_thermal_trace ("boot_id,time,name,value"), value in mC. Names
+ * are mapped to CBC signal ids with the signal lines of cbc_thermal.conf.
+ * Fan commands are decoded with its fan lines, one duty byte per fan;
+ * the metrics follow the first fan.
+ *
+ * A pty has no frame boundaries, while cbc_thermal parses one frame per
+ * read(). Frames are written one per tick on each pty, and only once
+ * the previous one left the input queue of the slave, so each read()
+ * gets one frame. This holds as long as the pty delivers a write
+ * within a tick; samples and reports which wait are coalesced.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <math.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#define pr_log(fmt, ...) fprintf(stderr, "[CBC Replay] " fmt, ## __VA_ARGS__)
+#define ASSERT(cond, fmt, ...) do {\
+		if (!(cond)) { \
+			pr_log("ASSERT " fmt "\n", ## __VA_ARGS__); \
+			exit(1); \
+		} \
+        } while(0)
+
+#define RP_CONF_FILE "/etc/ioc-cbc-tools/cbc_thermal.conf"
+#define RP_CONF_DEFAULT_FILE "/usr/share/ioc-cbc-tools/cbc_thermal.conf"
+#define RP_NAME_MAX 64
+#define RP_LINE_MAX 256
+#define RP_SIG_MAX 255			/* signals in one frame */
+#define RP_TICK_NS 2000000ull		/* wall time between two frames */
+#define RP_REPORT_PERIOD 1.0		/* s of trace time between duty reports */
+#define RP_FAN_MAX 8
+#define RP_FAN_INDEX_MAX 8		/* duties in one command frame */
+#define RP_REPORT_LEN 4			/* shortest duty report */
+
+struct rp_signal {
+	char name[RP_NAME_MAX];
+	unsigned short id;
+	int scale;
+	int offset;
+	int pending;			/* a value is waiting for the next frame */
+	int raw;
+};
+
+static struct rp_signal rp_signals[RP_SIG_MAX];
+static int rp_signals_num;
+
+/* fan | name | cmd | index | min | max | report, as in cbc_thermal */
+struct rp_fan {
+	char name[RP_NAME_MAX];
+	unsigned int cmd;
+	unsigned int report;
+	int index;
+	int duty;			/* last commanded duty, -1 if none */
+	int report_pending;		/* a report is waiting for the pty */
+};
+
+static struct rp_fan rp_fans[RP_FAN_MAX];
+static int rp_fans_num;
+
+/* master side written by the replay, slave side read by cbc_thermal */
+struct rp_port {
+	int fd;
+	int slave;
+	double last_write;
+};
+
+static struct rp_port rp_sig, rp_diag;
+
+static double rp_speed = 1;
+static double rp_plant_k;		/* mC per duty percent */
+static double rp_plant_tau = 10;	/* s */
+static int rp_trip = 60000;		/* mC */
+static const char *rp_sensor;		/* signal checked against rp_trip */
+
+/* results */
+static double rp_fan_eff;		/* lagged duty seen by the plant model */
+static int rp_duty = -1;		/* last commanded duty */
+static double rp_duty_ts;
+static double rp_duty_sum, rp_duty_cube_sum;
+static unsigned long rp_cmds, rp_samples, rp_frames;
+static double rp_cross_ts = -1;		/* last crossing without reaction yet */
+static int rp_cross_duty;
+static unsigned long rp_crossings, rp_reactions;
+static double rp_latency_sum, rp_latency_max;
+static double rp_overshoot, rp_above_time, rp_last_temp_ts = -1;
+static int rp_last_temp, rp_have_temp;
+
+static FILE *rp_fan_log;
+
+static struct rp_signal *rp_signal_find(const char *name)
+{
+	char *end;
+	long id = strtol(name, &end, 0);
+	int i;
+
+	for (i = 0; i < rp_signals_num; i++)
+		if (strcmp(rp_signals[i].name, name) == 0 || (!*end && rp_signals[i].id == id))
+			return &rp_signals[i];
+	return NULL;
+}
+
+static struct rp_fan *rp_fan_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < rp_fans_num; i++)
+		if (strcmp(rp_fans[i].name, name) == 0)
+			return &rp_fans[i];
+	return NULL;
+}
+
+static void rp_fan_add(const char *path, const char *line)
+{
+	struct rp_fan *f = &rp_fans[rp_fans_num];
+	int min, max;
+
+	if (rp_fans_num >= RP_FAN_MAX) {
+		pr_log("%s: too many fans: %s", path, line);
+		return;
+	}
+	if (sscanf(line, "%*s | %63s | %i | %d | %d | %d | %i", f->name, &f->cmd, &f->index,
+		   &min, &max, &f->report) != 6 || f->cmd > 0xff || f->report > 0xff ||
+	    f->index < 0 || f->index >= RP_FAN_INDEX_MAX) {
+		pr_log("%s: invalid line: %s", path, line);
+		return;
+	}
+	f->duty = -1;
+	rp_fans_num++;
+}
+
+/* signal and fan lines of cbc_thermal.conf: signal | id | name | scale | offset | [unit] */
+static int rp_conf_load(const char *path)
+{
+	char line[RP_LINE_MAX], key[16];
+	struct rp_signal *s;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || sscanf(line, "%15s", key) != 1)
+			continue;
+		if (strcmp(key, "fan") == 0) {
+			rp_fan_add(path, line);
+			continue;
+		}
+		if (strcmp(key, "signal") || rp_signals_num >= RP_SIG_MAX)
+			continue;
+		s = &rp_signals[rp_signals_num];
+		if (sscanf(line, "%*s | %hu | %63s | %d | %d", &s->id, s->name, &s->scale, &s->offset) != 4 ||
+		    !s->scale) {
+			pr_log("%s: invalid line: %s", path, line);
+			continue;
+		}
+		rp_signals_num++;
+	}
+	fclose(file);
+	pr_log("%d signals, %d fans from %s\n", rp_signals_num, rp_fans_num, path);
+	return 0;
+}
+
+static void rp_default_signals(void)
+{
+	static const struct rp_signal defaults[] = {
+		{ "cbc_amplifier_temp", 502, 10, -100000 },
+		{ "cbc_env_temp", 503, 10, -100000 },
+		{ "cbc_ambient_temp", 870, 10, -100000 },
+	};
+
+	memcpy(rp_signals, defaults, sizeof(defaults));
+	rp_signals_num = sizeof(defaults) / sizeof(defaults[0]);
+}
+
+/* the cbc_thermal default without fan lines */
+static void rp_default_fans(void)
+{
+	static const struct rp_fan fan0 = { "cbc_fan0", 0x08, 0x09, 0, -1 };
+
+	rp_fans[0] = fan0;
+	rp_fans_num = 1;
+}
+
+static void rp_pty(struct rp_port *port, char *name, size_t size)
+{
+	struct termios tio;
+	int fd, slave;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	ASSERT(fd >= 0 && grantpt(fd) == 0 && unlockpt(fd) == 0, "posix_openpt error");
+	snprintf(name, size, "%s", ptsname(fd));
+	/* keep the slave open and raw, frames must pass unchanged */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	ASSERT(slave >= 0 && tcgetattr(slave, &tio) == 0, "open %s error", name);
+	cfmakeraw(&tio);
+	ASSERT(tcsetattr(slave, TCSANOW, &tio) == 0, "tcsetattr %s error", name);
+	port->fd = fd;
+	port->slave = slave;
+}
+
+static double rp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fan duty integrals and plant model up to trace time t */
+static void rp_fan_advance(double t)
+{
+	double dt;
+
+	if (rp_duty < 0 || t <= rp_duty_ts)
+		return;
+	dt = t - rp_duty_ts;
+	rp_duty_sum += rp_duty * dt;
+	rp_duty_cube_sum += pow(rp_duty / 100.0, 3) * dt;
+	rp_fan_eff += (rp_duty - rp_fan_eff) * (1 - exp(-dt / rp_plant_tau));
+	rp_duty_ts = t;
+}
+
+static void rp_fan_command(int duty, double t)
+{
+	rp_fan_advance(t);
+	if (rp_duty < 0)
+		rp_duty_ts = t;
+	if (rp_fan_log)
+		fprintf(rp_fan_log, "%.3f,%d\n", t, duty);
+	if (rp_cross_ts >= 0 && duty > rp_cross_duty) {
+		double latency = t - rp_cross_ts;
+
+		rp_reactions++;
+		rp_latency_sum += latency;
+		if (latency > rp_latency_max)
+			rp_latency_max = latency;
+		rp_cross_ts = -1;
+	}
+	rp_duty = duty;
+}
+
+/* temperature of the checked sensor as fed to cbc_thermal */
+static void rp_check(int temp, double t)
+{
+	if (rp_have_temp && rp_last_temp > rp_trip)
+		rp_above_time += t - rp_last_temp_ts;
+	if (temp > rp_trip && (!rp_have_temp || rp_last_temp <= rp_trip)) {
+		rp_crossings++;
+		rp_cross_ts = t;
+		rp_cross_duty = rp_duty;
+	}
+	if (temp - rp_trip > rp_overshoot)
+		rp_overshoot = temp - rp_trip;
+	rp_last_temp = temp;
+	rp_last_temp_ts = t;
+	rp_have_temp = 1;
+}
+
+/* one frame per tick, and none while cbc_thermal has not read the last one */
+static int rp_port_idle(struct rp_port *port)
+{
+	int queued = 0;
+
+	if (rp_now() - port->last_write < RP_TICK_NS / 1e9)
+		return 0;
+	return ioctl(port->slave, FIONREAD, &queued) < 0 || !queued;
+}
+
+static void rp_write(struct rp_port *port, const unsigned char *buf, int len)
+{
+	int ret;
+
+	port->last_write = rp_now();
+	while (len > 0) {
+		ret = write(port->fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		ASSERT(ret > 0, "write error %d", errno);
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* length of a command frame: the cmd byte and a duty up to the last index, 0 if unknown */
+static int rp_fan_frame_len(unsigned int cmd)
+{
+	int i, len = 0;
+
+	for (i = 0; i < rp_fans_num; i++)
+		if (rp_fans[i].cmd == cmd && len < 2 + rp_fans[i].index)
+			len = 2 + rp_fans[i].index;
+	return len;
+}
+
+/* queue a duty report for the fans of a command, for all fans if cmd is -1 */
+static void rp_fan_reports(int cmd)
+{
+	int i;
+
+	for (i = 0; i < rp_fans_num; i++)
+		if (cmd < 0 || rp_fans[i].cmd == (unsigned int)cmd)
+			rp_fans[i].report_pending = 1;
+}
+
+/* one queued report: the duties of all commanded fans with its id, as the IOC reports them */
+static void rp_fan_report_send(struct rp_port *port)
+{
+	unsigned char report[2 + RP_FAN_INDEX_MAX];
+	int i, j, len, duties;
+
+	if (!rp_port_idle(port))
+		return;
+	for (i = 0; i < rp_fans_num; i++) {
+		if (!rp_fans[i].report_pending)
+			continue;
+		memset(report, 0, sizeof(report));
+		report[0] = rp_fans[i].report;
+		len = RP_REPORT_LEN;
+		duties = 0;
+		for (j = i; j < rp_fans_num; j++) {
+			struct rp_fan *f = &rp_fans[j];
+
+			if (f->report != report[0])
+				continue;
+			f->report_pending = 0;
+			if (f->duty < 0)
+				continue;
+			report[1 + f->index] = f->duty;
+			if (len < 2 + f->index)
+				len = 2 + f->index;
+			duties++;
+		}
+		if (duties) {
+			rp_write(port, report, len);
+			return;
+		}
+	}
+}
+
+/* a complete command frame {cmd, duty of index 0, duty of index 1, ...} */
+static void rp_fan_frame(const unsigned char *frame, double t)
+{
+	int i;
+
+	rp_cmds++;
+	for (i = 0; i < rp_fans_num; i++) {
+		struct rp_fan *f = &rp_fans[i];
+
+		if (f->cmd != frame[0])
+			continue;
+		f->duty = frame[1 + f->index];
+		if (i == 0)
+			rp_fan_command(f->duty, t);
+	}
+	rp_fan_reports(frame[0]);
+}
+
+/* one frame with the latest value of every signal updated since the last frame */
+static void rp_send_frame(struct rp_port *port)
+{
+	unsigned char frame[2 + RP_SIG_MAX * 6];
+	unsigned char *p = frame + 2;
+	int i, num = 0;
+
+	if (!rp_port_idle(port))
+		return;
+	for (i = 0; i < rp_signals_num; i++) {
+		struct rp_signal *s = &rp_signals[i];
+
+		if (!s->pending)
+			continue;
+		s->pending = 0;
+		*p++ = s->id & 0xff;
+		*p++ = s->id >> 8;
+		*p++ = s->raw & 0xff;
+		*p++ = (s->raw >> 8) & 0xff;
+		*p++ = 0;
+		*p++ = 0;
+		num++;
+	}
+	if (!num)
+		return;
+	frame[0] = 0x2;
+	frame[1] = num;
+	rp_write(port, frame, p - frame);
+	rp_frames++;
+}
+
+/* next "time,name,value" sample of the trace, -1 at the end */
+static int rp_next_sample(FILE *trace, double *t, char *name, int *val)
+{
+	char line[RP_LINE_MAX], *f[4], *p;
+	int n;
+
+	while (fgets(line, sizeof(line), trace)) {
+		line[strcspn(line, "\r\n")] = 0;
+		for (n = 0, p = line; n < 4 && p; n++) {
+			f[n] = p;
+			p = strchr(p, ',');
+			if (p)
+				*p++ = 0;
+		}
+		if (n < 3 || p)
+			continue;
+		/* cbc_thermal_trace lines start with the boot id */
+		if (n == 4)
+			memmove(f, f + 1, 3 * sizeof(f[0]));
+		if (!f[0][0] || strspn(f[0], "0123456789.") != strlen(f[0]))
+			continue;
+		*t = atof(f[0]);
+		snprintf(name, RP_NAME_MAX, "%s", f[1]);
+		*val = atoi(f[2]);
+		return 0;
+	}
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options] <trace.csv> [-- <cbc_thermal command>]\n"
+		"  -c  cbc_thermal.conf with the signal and fan lines, default " RP_CONF_FILE "\n"
+		"  -x  replay speed factor, default 1\n"
+		"  -T  trip point in mC for the metrics, default 60000\n"
+		"  -n  sensor checked against the trip point, default the first one replayed\n"
+		"  -k  plant model: mC removed per fan duty percent, default 0 (open loop)\n"
+		"  -u  plant model: fan effect time constant in s, default 10\n"
+		"  -o  fan command log, CSV \"time,duty\"\n"
+		"The metrics, the plant model and the log follow the first fan of the config.\n"
+		"The cbc_thermal command is started with \"-s <signals pty> -d <diagnosis pty>\"\n"
+		"appended. Without it, the pty names are printed and cbc_thermal is expected\n"
+		"to be started by hand.\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	char sig_name[64], diag_name[64], name[RP_NAME_MAX];
+	const char *conf = NULL;
+	unsigned char buf[256], frame[2 + RP_FAN_INDEX_MAX];
+	int c, i, len, max_fd, val, eof, frame_len = 0, frame_pos = 0;
+	double t0, start, next_t, next_report, sim, end_t = 0;
+	struct rp_signal *s;
+	struct timeval tv;
+	pid_t child = -1;
+	FILE *trace;
+	fd_set rfd;
+
+	while ((c = getopt(argc, argv, "c:x:T:n:k:u:o:h")) != -1) {
+		switch (c) {
+		case 'c':
+			conf = optarg;
+			break;
+		case 'x':
+			rp_speed = atof(optarg);
+			break;
+		case 'T':
+			rp_trip = atoi(optarg);
+			break;
+		case 'n':
+			rp_sensor = optarg;
+			break;
+		case 'k':
+			rp_plant_k = atof(optarg);
+			break;
+		case 'u':
+			rp_plant_tau = atof(optarg);
+			break;
+		case 'o':
+			rp_fan_log = fopen(optarg, "w");
+			ASSERT(rp_fan_log, "open %s error", optarg);
+			fprintf(rp_fan_log, "time,duty\n");
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (optind >= argc || rp_speed <= 0 || rp_plant_tau <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	trace = fopen(argv[optind], "r");
+	ASSERT(trace, "open %s error", argv[optind]);
+	if (conf)
+		ASSERT(rp_conf_load(conf) == 0, "open %s error", conf);
+	else if (rp_conf_load(RP_CONF_FILE) < 0 && rp_conf_load(RP_CONF_DEFAULT_FILE) < 0)
+		rp_default_signals();
+	if (!rp_fans_num)
+		rp_default_fans();
+
+	rp_pty(&rp_sig, sig_name, sizeof(sig_name));
+	rp_pty(&rp_diag, diag_name, sizeof(diag_name));
+	max_fd = rp_sig.fd > rp_diag.fd ? rp_sig.fd : rp_diag.fd;
+	signal(SIGPIPE, SIG_IGN);
+
+	if (optind + 1 < argc) {
+		char **cmd = calloc(argc - optind + 4, sizeof(*cmd));
+
+		ASSERT(cmd, "out of memory");
+		for (i = optind + 1; i < argc; i++)
+			cmd[i - optind - 1] = argv[i];
+		i = argc - optind - 1;
+		cmd[i++] = "-s";
+		cmd[i++] = sig_name;
+		cmd[i++] = "-d";
+		cmd[i++] = diag_name;
+		child = fork();
+		ASSERT(child >= 0, "fork error");
+		if (child == 0) {
+			execvp(cmd[0], cmd);
+			pr_log("exec %s error %d\n", cmd[0], errno);
+			_exit(127);
+		}
+	} else {
+		printf("signals pty: %s\ndiagnosis pty: %s\n", sig_name, diag_name);
+		fflush(stdout);
+	}
+
+	/* cbc_thermal writes 0xff to the signals device once it is ready */
+	pr_log("wait for cbc_thermal ...\n");
+	do {
+		len = read(rp_sig.fd, buf, sizeof(buf));
+	} while (len <= 0 || !memchr(buf, 0xff, len));
+
+	eof = rp_next_sample(trace, &next_t, name, &val);
+	ASSERT(!eof, "%s: no samples", argv[optind]);
+	t0 = next_t;
+	next_report = t0;
+	start = rp_now();
+	pr_log("replay %s at %gx\n", argv[optind], rp_speed);
+
+	while (1) {
+		sim = t0 + (rp_now() - start) * rp_speed;
+
+		/* samples due, the latest value of a signal wins */
+		while (!eof && next_t <= sim) {
+			s = rp_signal_find(name);
+			if (s) {
+				int temp = val - (int)(rp_plant_k * rp_fan_eff);
+
+				rp_fan_advance(next_t);
+				s->raw = (temp - s->offset) / s->scale;
+				s->pending = 1;
+				rp_samples++;
+				if (!rp_sensor)
+					rp_sensor = s->name;
+				if (strcmp(rp_sensor, s->name) == 0)
+					rp_check(temp, next_t);
+			} else if (!rp_fan_find(name)) {
+				pr_log("unknown signal %s\n", name);
+			}
+			end_t = next_t;
+			eof = rp_next_sample(trace, &next_t, name, &val);
+		}
+		rp_send_frame(&rp_sig);
+
+		/* the IOC reports the fan duty periodically */
+		if (sim >= next_report) {
+			rp_fan_reports(-1);
+			next_report = sim + RP_REPORT_PERIOD;
+		}
+		rp_fan_report_send(&rp_diag);
+		if (eof)
+			break;
+
+		FD_ZERO(&rfd);
+		FD_SET(rp_sig.fd, &rfd);
+		FD_SET(rp_diag.fd, &rfd);
+		tv.tv_sec = 0;
+		tv.tv_usec = RP_TICK_NS / 1000;
+		if (select(max_fd + 1, &rfd, NULL, NULL, &tv) <= 0)
+			continue;
+		if (FD_ISSET(rp_sig.fd, &rfd))
+			len = read(rp_sig.fd, buf, sizeof(buf));
+		if (FD_ISSET(rp_diag.fd, &rfd)) {
+			len = read(rp_diag.fd, buf, sizeof(buf));
+			if (len <= 0) {
+				pr_log("cbc_thermal closed the diagnosis device\n");
+				break;
+			}
+			sim = t0 + (rp_now() - start) * rp_speed;
+			/* command frames, they may arrive merged or split */
+			for (i = 0; i < len; i++) {
+				if (!frame_pos) {
+					frame_len = rp_fan_frame_len(buf[i]);
+					if (!frame_len) {
+						pr_log("unknown command 0x%02x\n", buf[i]);
+						continue;
+					}
+				}
+				frame[frame_pos++] = buf[i];
+				if (frame_pos < frame_len)
+					continue;
+				rp_fan_frame(frame, sim);
+				next_report = sim + RP_REPORT_PERIOD;
+				frame_pos = 0;
+			}
+		}
+	}
+	rp_fan_advance(end_t);
+	if (rp_have_temp && rp_last_temp > rp_trip)
+		rp_above_time += end_t - rp_last_temp_ts;
+
+	printf("trace: %.1f s at %gx, %lu samples in %lu frames\n", end_t - t0, rp_speed, rp_samples, rp_frames);
+	printf("fan commands: %lu\n", rp_cmds);
+	printf("%s trip %d mC: %lu crossings, %lu reactions", rp_sensor ? rp_sensor : "-", rp_trip,
+		rp_crossings, rp_reactions);
+	if (rp_reactions)
+		printf(", latency mean %.3f s max %.3f s", rp_latency_sum / rp_reactions, rp_latency_max);
+	printf("\n");
+	printf("overshoot: max %.0f mC, %.1f s above trip\n", rp_overshoot, rp_above_time);
+	printf("fan energy: %.0f duty%%*s, mean duty %.1f%%, %.1f s at full power (cubic)\n",
+		rp_duty_sum, end_t > t0 ? rp_duty_sum / (end_t - t0) : 0, rp_duty_cube_sum);
+
+	if (rp_fan_log)
+		fclose(rp_fan_log);
+	fclose(trace);
+	if (child > 0) {
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+	}
+	return 0;
+}
@@ -0,0 +1,685 @@
+/*
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * SPDX-License-identifier: BSD-3-Clause
+ */
+
+/*
+ * Native sampler for cbc_thermal_chart.py. It records the same columns
+ * as the chart record mode, but keeps every source open, reads it with
+ * pread() on a timerfd cadence and writes a binary log (cbc_thermal.h).
+ * "-x" converts a log back to the CSV read by csv_to_svg().
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "cbc_thermal.h"
+
+#define pr_log(fmt, ...) fprintf(stderr, "[CBC Sampler] " fmt, ## __VA_ARGS__)
+#define ASSERT(cond, fmt, ...) do {\
+		if (!(cond)) { \
+			pr_log("ASSERT " fmt "\n", ## __VA_ARGS__); \
+			exit(1); \
+		} \
+        } while(0)
+
+#define SMP_COL_MAX 256
+#define SMP_PATH_MAX 256
+#define SMP_BATCH 64			/* records per write() */
+#define SMP_GPU_DEV "/sys/bus/pci/devices/0000:00:02.0"
+#define SMP_GPU_TICK 10			/* ms between GPU ring samples */
+#define SMP_GPU_WINDOW 100		/* GPU ring samples per usage value */
+#define SMP_CONFIG "/etc/ioc-cbc-tools/thermal-conf.xml"
+
+enum {
+	SMP_CPU_USAGE,
+	SMP_GPU_USAGE,
+	SMP_ENERGY,			/* energy_uj, logged as uW */
+	SMP_VALUE,			/* integer sysfs or cbc_thermal file */
+};
+
+struct smp_col {
+	struct cbc_th_sample_column desc;
+	int kind;
+	int fd;
+	int64_t last;			/* SMP_ENERGY: uj of the previous read */
+	uint64_t last_ns;
+	int64_t range;			/* SMP_ENERGY: max_energy_range_uj */
+};
+
+static struct smp_col smp_cols[SMP_COL_MAX];
+static int smp_cols_num;
+
+static uint64_t smp_cpu_total, smp_cpu_idle;
+
+static volatile uint32_t *smp_gpu_mmio;
+static int smp_gpu_total, smp_gpu_idle, smp_gpu_usage;
+
+static volatile sig_atomic_t smp_stop;
+
+static uint64_t smp_now(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct smp_col *smp_col_add(int kind, int fd, int decimals, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static struct smp_col *smp_col_add(int kind, int fd, int decimals, const char *fmt, ...)
+{
+	struct smp_col *col;
+	va_list ap;
+
+	if (smp_cols_num >= SMP_COL_MAX) {
+		pr_log("too many columns\n");
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	col = &smp_cols[smp_cols_num++];
+	va_start(ap, fmt);
+	vsnprintf(col->desc.name, sizeof(col->desc.name), fmt, ap);
+	va_end(ap);
+	col->desc.decimals = decimals;
+	col->kind = kind;
+	col->fd = fd;
+	return col;
+}
+
+/* read one integer from a held-open file, -1 on error */
+static int smp_pread_int(int fd, int64_t *val)
+{
+	char buf[64];
+	int len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	*val = strtoll(buf, NULL, 10);
+	return 0;
+}
+
+static int smp_read_str(const char *path, char *buf, int size)
+{
+	int fd = open(path, O_RDONLY);
+	int len;
+
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == 0))
+		len--;
+	buf[len] = 0;
+	return 0;
+}
+
+/* open path only if it can be read, as the chart script does */
+static int smp_open_readable(const char *path)
+{
+	int64_t val;
+	int fd = open(path, O_RDONLY);
+
+	if (fd >= 0 && smp_pread_int(fd, &val) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/* percent of busy time in hundredths since the previous call */
+static int smp_cpu_usage(int fd)
+{
+	char buf[256];
+	unsigned long long v[10] = { 0 };
+	uint64_t total = 0, idle, diff;
+	int i, len, usage = 0;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buf[len] = 0;
+	sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9]);
+	for (i = 0; i < 10; i++)
+		total += v[i];
+	idle = v[3];
+	if (total > smp_cpu_total) {
+		if (smp_cpu_total) {
+			diff = total - smp_cpu_total;
+			usage = (diff - (idle - smp_cpu_idle)) * 10000 / diff;
+			if (usage < 1)
+				usage = 1;
+		}
+		smp_cpu_total = total;
+		smp_cpu_idle = idle;
+	}
+	return usage;
+}
+
+static void smp_gpu_sample(void)
+{
+	uint32_t head = smp_gpu_mmio[0x2034 / 4] & 0x001ffffc;
+	uint32_t tail = smp_gpu_mmio[0x2030 / 4] & 0x000ffff8;
+
+	smp_gpu_total++;
+	if (head == tail)
+		smp_gpu_idle++;
+	if (smp_gpu_total == SMP_GPU_WINDOW) {
+		smp_gpu_usage = 10000 - smp_gpu_idle * 10000 / smp_gpu_total;
+		smp_gpu_total = smp_gpu_idle = 0;
+	}
+}
+
+static void smp_scan_cpu(int all_cpu)
+{
+	char path[SMP_PATH_MAX];
+	int64_t val;
+	int i, fd;
+
+	fd = open("/proc/stat", O_RDONLY);
+	ASSERT(fd >= 0, "open /proc/stat error");
+	smp_col_add(SMP_CPU_USAGE, fd, 2, "cpu%%");
+	smp_cpu_usage(fd);
+
+	for (i = 0; i < (all_cpu ? 99 : 1); i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", i);
+		fd = open(path, O_RDONLY);
+		/* cpu0 is always logged, others only while they report a frequency */
+		if (i > 0 && (fd < 0 || smp_pread_int(fd, &val) < 0 || val == 0)) {
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+		smp_col_add(SMP_VALUE, fd, 0, "cpu%d_freq", i);
+	}
+}
+
+static void smp_scan_gpu(void)
+{
+	char buf[32];
+	void *mmio;
+	int fd;
+
+	if (smp_read_str(SMP_GPU_DEV "/vendor", buf, sizeof(buf)) < 0 || strcmp(buf, "0x8086"))
+		goto err;
+	if (smp_read_str(SMP_GPU_DEV "/class", buf, sizeof(buf)) < 0 ||
+	    (strtol(buf, NULL, 16) & 0x30000) != 0x30000)
+		goto err;
+	fd = open(SMP_GPU_DEV "/resource0", O_RDONLY);
+	if (fd < 0)
+		goto err;
+	mmio = mmap(NULL, 0x3000, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mmio == MAP_FAILED)
+		goto err;
+	smp_gpu_mmio = mmio;
+	smp_col_add(SMP_GPU_USAGE, -1, 2, "gpu%%");
+	return;
+err:
+	pr_log("cannot find intel gpu device\n");
+}
+
+static int smp_scandir_filter(const struct dirent *d)
+{
+	return d->d_name[0] != '.';
+}
+
+static void smp_scan_rapl(void)
+{
+	static struct smp_col limits[SMP_COL_MAX];
+	char path[SMP_PATH_MAX], name[64], cname[64];
+	struct dirent **dirs;
+	struct smp_col *col;
+	int i, j, n, fd, limits_num = 0;
+	int64_t val;
+
+	n = scandir("/sys/class/powercap", &dirs, smp_scandir_filter, alphasort);
+	if (n < 0)
+		return;
+	/* the first entry is the control type, not a zone */
+	for (i = 1; i < n; i++) {
+		const char *rd = dirs[i]->d_name;
+
+		snprintf(path, sizeof(path), "/sys/class/powercap/%.64s/name", rd);
+		if (smp_read_str(path, name, sizeof(name)) < 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/powercap/%.64s/energy_uj", rd);
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || smp_pread_int(fd, &val) < 0) {
+			if (fd >= 0)
+				close(fd);
+			continue;
+		}
+		col = smp_col_add(SMP_ENERGY, fd, 0, "%s:%s:energy_uw", rd, name);
+		if (!col)
+			break;
+		col->last = val;
+		col->last_ns = smp_now(CLOCK_MONOTONIC);
+		snprintf(path, sizeof(path), "/sys/class/powercap/%.64s/max_energy_range_uj", rd);
+		if (smp_read_str(path, cname, sizeof(cname)) == 0)
+			col->range = strtoll(cname, NULL, 10);
+
+		for (j = 0; j < 99 && limits_num < SMP_COL_MAX; j++) {
+			snprintf(path, sizeof(path), "/sys/class/powercap/%.64s/constraint_%d_name", rd, j);
+			if (smp_read_str(path, cname, sizeof(cname)) < 0)
+				break;
+			snprintf(path, sizeof(path), "/sys/class/powercap/%.64s/constraint_%d_power_limit_uw", rd, j);
+			fd = smp_open_readable(path);
+			if (fd < 0)
+				break;
+			col = &limits[limits_num++];
+			snprintf(col->desc.name, sizeof(col->desc.name), "%.16s:%.16s:%.13s", rd, name, cname);
+			col->kind = SMP_VALUE;
+			col->fd = fd;
+		}
+	}
+	for (i = 0; i < n; i++)
+		free(dirs[i]);
+	free(dirs);
+	/* power limits follow all energy columns */
+	for (i = 0; i < limits_num; i++)
+		if (!smp_col_add(SMP_VALUE, limits[i].fd, 0, "%s", limits[i].desc.name))
+			break;
+}
+
+static void smp_scan_sensors(void)
+{
+	char path[SMP_PATH_MAX], type[64];
+	int i, fd;
+
+	for (i = 0; i < 99; i++) {
+		snprintf(path, sizeof(path), "/sys/class/thermal/thermal_zone%d/type", i);
+		if (smp_read_str(path, type, sizeof(type)) < 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/thermal/thermal_zone%d/temp", i);
+		fd = smp_open_readable(path);
+		if (fd >= 0)
+			smp_col_add(SMP_VALUE, fd, 0, "%s:z%d", type, i);
+	}
+}
+
+static void smp_scan_cdevs(int all_cpu)
+{
+	char path[SMP_PATH_MAX], type[64];
+	int i, fd, cpu_index = 0;
+
+	for (i = 0; i < 99; i++) {
+		snprintf(path, sizeof(path), "/sys/class/thermal/cooling_device%d/type", i);
+		if (smp_read_str(path, type, sizeof(type)) < 0)
+			continue;
+		if (strcmp(type, "Processor") == 0 && cpu_index > 0 && !all_cpu)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/thermal/cooling_device%d/cur_state", i);
+		fd = smp_open_readable(path);
+		if (fd < 0)
+			continue;
+		if (strcmp(type, "Processor") == 0)
+			smp_col_add(SMP_VALUE, fd, 0, "cdev_cpu_%d", cpu_index++);
+		else
+			smp_col_add(SMP_VALUE, fd, 0, "%s:c%d", type, i);
+	}
+}
+
+/* text of the first <tag> between p and end, NULL if none */
+static const char *smp_xml_tag(const char *p, const char *end, const char *tag,
+			       char *out, int size)
+{
+	char open_tag[64], close_tag[64];
+	const char *s, *e;
+	int len;
+
+	snprintf(open_tag, sizeof(open_tag), "<%s>", tag);
+	snprintf(close_tag, sizeof(close_tag), "</%s>", tag);
+	s = strstr(p, open_tag);
+	if (!s || s >= end)
+		return NULL;
+	s += strlen(open_tag);
+	e = strstr(s, close_tag);
+	if (!e || e > end)
+		return NULL;
+	if (out) {
+		while (s < e && (*s == ' ' || *s == '\t' || *s == '\n'))
+			s++;
+		len = e - s < size - 1 ? e - s : size - 1;
+		memcpy(out, s, len);
+		while (len > 0 && (out[len - 1] == ' ' || out[len - 1] == '\t' || out[len - 1] == '\n'))
+			len--;
+		out[len] = 0;
+	}
+	return e + strlen(close_tag);
+}
+
+/* add <tag> blocks (ThermalSensor or CoolingDevice) of the block [p, end) */
+static void smp_xml_add(const char *p, const char *end, const char *tag)
+{
+	char open_tag[64], close_tag[64], type[64], path[SMP_PATH_MAX];
+	const char *s, *e;
+	int fd;
+
+	snprintf(open_tag, sizeof(open_tag), "<%s>", tag);
+	snprintf(close_tag, sizeof(close_tag), "</%s>", tag);
+	while ((s = strstr(p, open_tag)) && s < end) {
+		e = strstr(s, close_tag);
+		if (!e || e > end)
+			break;
+		if (smp_xml_tag(s, e, "Type", type, sizeof(type)) &&
+		    smp_xml_tag(s, e, "Path", path, sizeof(path))) {
+			fd = open(path, O_RDONLY);
+			if (fd >= 0)
+				smp_col_add(SMP_VALUE, fd, 0, "%s", type);
+			else
+				pr_log("open %s error\n", path);
+		}
+		p = e + strlen(close_tag);
+	}
+}
+
+/* sensors and cooling devices of the thermald platform matching product */
+static void smp_scan_config(const char *config, const char *product, int cdevs)
+{
+	char name[64], *buf;
+	const char *p, *end;
+	struct stat st;
+	FILE *file;
+
+	file = fopen(config, "r");
+	if (!file || fstat(fileno(file), &st) < 0 || !(buf = calloc(1, st.st_size + 1))) {
+		pr_log("parse %s error\n", config);
+		if (file)
+			fclose(file);
+		return;
+	}
+	if (fread(buf, 1, st.st_size, file) != (size_t)st.st_size)
+		pr_log("parse %s error\n", config);
+	fclose(file);
+
+	for (p = buf; (p = strstr(p, "<Platform>")); p = end) {
+		end = strstr(p, "</Platform>");
+		if (!end)
+			break;
+		if (!smp_xml_tag(p, end, "ProductName", name, sizeof(name)) || strcmp(name, product))
+			continue;
+		if (cdevs)
+			smp_xml_add(p, end, "CoolingDevice");
+		else
+			smp_xml_add(p, end, "ThermalSensor");
+		break;
+	}
+	free(buf);
+}
+
+static void smp_stop_handler(int sig)
+{
+	smp_stop = 1;
+}
+
+static int smp_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int smp_record(const char *output, int interval, int duration)
+{
+	struct cbc_th_sample_header header = {
+		.magic = CBC_TH_SAMPLE_MAGIC,
+		.version = CBC_TH_SAMPLE_VERSION,
+		.columns = smp_cols_num,
+		.interval_us = interval * 1000,
+		.record_size = sizeof(uint64_t) + sizeof(int64_t) * smp_cols_num,
+	};
+	struct itimerspec its = { { 0 } };
+	struct sigaction sa = { .sa_handler = smp_stop_handler };
+	uint64_t exp, ticks = 0, records = 0, missed = 0, start, now;
+	struct rusage ru;
+	char *batch, *rec;
+	int i, fd, tfd, tick, tick_per_record, batched = 0;
+	int64_t val;
+
+	fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ASSERT(fd >= 0, "open %s error", output);
+	if (smp_write(fd, &header, sizeof(header)) < 0)
+		ASSERT(0, "write %s error", output);
+	for (i = 0; i < smp_cols_num; i++)
+		if (smp_write(fd, &smp_cols[i].desc, sizeof(smp_cols[i].desc)) < 0)
+			ASSERT(0, "write %s error", output);
+
+	batch = malloc(header.record_size * SMP_BATCH);
+	ASSERT(batch, "out of memory");
+
+	/* the GPU ring is sampled on a finer tick than the records */
+	tick = interval;
+	if (smp_gpu_mmio && interval > SMP_GPU_TICK && interval % SMP_GPU_TICK == 0)
+		tick = SMP_GPU_TICK;
+	tick_per_record = interval / tick;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	ASSERT(tfd >= 0, "timerfd_create error");
+	its.it_value.tv_nsec = 1;
+	its.it_interval.tv_sec = tick / 1000;
+	its.it_interval.tv_nsec = (tick % 1000) * 1000000l;
+	ASSERT(timerfd_settime(tfd, 0, &its, NULL) == 0, "timerfd_settime error");
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	start = smp_now(CLOCK_MONOTONIC);
+	while (!smp_stop && smp_now(CLOCK_MONOTONIC) - start < duration * 1000000000ull) {
+		if (read(tfd, &exp, sizeof(exp)) != sizeof(exp))
+			continue;
+		missed += exp - 1;
+		if (smp_gpu_mmio)
+			smp_gpu_sample();
+		if (ticks++ % tick_per_record)
+			continue;
+
+		rec = batch + header.record_size * batched;
+		now = smp_now(CLOCK_REALTIME);
+		memcpy(rec, &now, sizeof(now));
+		rec += sizeof(now);
+		now = smp_now(CLOCK_MONOTONIC);
+		for (i = 0; i < smp_cols_num; i++) {
+			struct smp_col *col = &smp_cols[i];
+			/* power limits in uW go beyond 32 bits */
+			int64_t v = 0;
+
+			switch (col->kind) {
+			case SMP_CPU_USAGE:
+				v = smp_cpu_usage(col->fd);
+				break;
+			case SMP_GPU_USAGE:
+				v = smp_gpu_usage;
+				break;
+			case SMP_ENERGY:
+				if (smp_pread_int(col->fd, &val) < 0)
+					break;
+				if (val < col->last && col->range)
+					v = (val + col->range - col->last) * 1000000000ll / (int64_t)(now - col->last_ns);
+				else if (now > col->last_ns)
+					v = (val - col->last) * 1000000000ll / (int64_t)(now - col->last_ns);
+				col->last = val;
+				col->last_ns = now;
+				break;
+			default:
+				if (smp_pread_int(col->fd, &val) == 0)
+					v = val;
+				break;
+			}
+			memcpy(rec, &v, sizeof(v));
+			rec += sizeof(v);
+		}
+		records++;
+		if (++batched == SMP_BATCH) {
+			if (smp_write(fd, batch, header.record_size * batched) < 0)
+				ASSERT(0, "write %s error", output);
+			batched = 0;
+		}
+	}
+	if (batched && smp_write(fd, batch, header.record_size * batched) < 0)
+		ASSERT(0, "write %s error", output);
+	close(fd);
+	close(tfd);
+	free(batch);
+
+	getrusage(RUSAGE_SELF, &ru);
+	now = smp_now(CLOCK_MONOTONIC) - start;
+	pr_log("%llu records, %llu missed ticks, %.3f%% cpu\n",
+		(unsigned long long)records, (unsigned long long)missed,
+		(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e11 / now +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e5 / now);
+	return 0;
+}
+
+static int smp_convert(const char *input)
+{
+	struct cbc_th_sample_header header;
+	struct cbc_th_sample_column *cols;
+	char *rec;
+	uint64_t ts;
+	int64_t v;
+	int32_t v32;
+	FILE *file;
+	double scale;
+	size_t size;
+	int i, j;
+
+	file = fopen(input, "r");
+	ASSERT(file, "open %s error", input);
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CBC_TH_SAMPLE_MAGIC ||
+	    (header.version != 1 && header.version != CBC_TH_SAMPLE_VERSION))
+		ASSERT(0, "%s: invalid sampler log", input);
+	/* version 1 logs have 32 bit values */
+	size = header.version == 1 ? sizeof(v32) : sizeof(v);
+	if (header.record_size != sizeof(ts) + size * header.columns)
+		ASSERT(0, "%s: invalid sampler log", input);
+	cols = calloc(header.columns, sizeof(*cols));
+	rec = malloc(header.record_size);
+	ASSERT(cols && rec, "out of memory");
+	if (fread(cols, sizeof(*cols), header.columns, file) != header.columns)
+		ASSERT(0, "%s: invalid sampler log", input);
+
+	printf("ts");
+	for (i = 0; i < header.columns; i++)
+		printf(",%.*s", CBC_TH_SAMPLE_NAME_MAX, cols[i].name);
+	printf("\n");
+	while (fread(rec, header.record_size, 1, file) == 1) {
+		memcpy(&ts, rec, sizeof(ts));
+		printf("%llu.%06llu", (unsigned long long)(ts / 1000000000ull),
+			(unsigned long long)(ts % 1000000000ull / 1000));
+		for (i = 0; i < header.columns; i++) {
+			if (size == sizeof(v32)) {
+				memcpy(&v32, rec + sizeof(ts) + size * i, size);
+				v = v32;
+			} else {
+				memcpy(&v, rec + sizeof(ts) + size * i, size);
+			}
+			if (cols[i].decimals) {
+				for (j = 0, scale = 1; j < cols[i].decimals; j++)
+					scale *= 10;
+				printf(",%.*f", cols[i].decimals, v / scale);
+			}
+			else
+				printf(",%lld", (long long)v);
+		}
+		printf("\n");
+	}
+	fclose(file);
+	free(cols);
+	free(rec);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-o <log>] [-i <interval ms>] [-t <seconds>] [-a] [-c <thermal-conf.xml>] [-p <product>]\n"
+		"       %s -x <log>\n"
+		"  -o  binary log to write, default cbc_thermal_sampler.bin\n"
+		"  -i  sampling interval in ms, default 1000\n"
+		"  -t  recording time in seconds, default 300\n"
+		"  -a  sample all cpus, default cpu0 only\n"
+		"  -c  CBC thermald config, default " SMP_CONFIG "\n"
+		"  -p  product name, default *\n"
+		"  -x  convert a log to CSV on stdout\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = "cbc_thermal_sampler.bin";
+	const char *config = SMP_CONFIG;
+	const char *product = "*";
+	int interval = 1000, duration = 300, all_cpu = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:i:t:ac:p:x:h")) != -1) {
+		switch (c) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'a':
+			all_cpu = 1;
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'p':
+			product = optarg;
+			break;
+		case 'x':
+			return smp_convert(optarg);
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (interval <= 0 || duration <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* same column order as cbc_thermal_chart.py record mode */
+	smp_scan_cpu(all_cpu);
+	smp_scan_gpu();
+	smp_scan_rapl();
+	smp_scan_sensors();
+	smp_scan_config(config, product, 0);
+	smp_scan_cdevs(all_cpu);
+	smp_scan_config(config, product, 1);
+
+	return smp_record(output, interval, duration);
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * SPDX-License-identifier: BSD-3-Clause
+ */
+
+/*
+ * Shared memory sensor page published by cbc_thermal.
+ *
+ * cbc_thermal keeps the current value of every sensor and cooling device
+ * in the read-only POSIX shared memory object CBC_TH_SHM_NAME
+ * (/dev/shm/cbc_thermal). Readers map it once and then read values with
+ * plain loads, without any system call:
+ *
+ *	struct cbc_th_shm *shm = cbc_th_shm_map();
+ *	int idx = cbc_th_shm_find(shm, "cbc_env_temp");
+ *	int32_t val;
+ *
+ *	if (idx >= 0 && cbc_th_shm_read(shm, idx, &val, NULL) == 0)
+ *		...
+ *
+ * Updates are protected by a sequence lock: seq is odd while cbc_thermal
+ * writes, readers retry until they copied an entry with the same even seq
+ * before and after. generation changes whenever cbc_thermal (re)creates
+ * the table, cached entry indexes must be looked up again then.
+ */
+
+#ifndef CBC_THERMAL_SHM_H
+#define CBC_THERMAL_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CBC_TH_SHM_NAME		"/cbc_thermal"
+#define CBC_TH_SHM_MAGIC	0x53485443	/* "CTHS" */
+#define CBC_TH_SHM_VERSION	1
+#define CBC_TH_SHM_NAME_MAX	32
+/* the object size never changes, so a mapping stays valid across restarts */
+#define CBC_TH_SHM_SIZE		16384
+#define CBC_TH_SHM_ENTRY_MAX	((CBC_TH_SHM_SIZE - sizeof(struct cbc_th_shm)) / \
+				sizeof(struct cbc_th_shm_entry))
+
+/* cbc_th_shm_entry.flags */
+#define CBC_TH_SHM_SENSOR	0x1
+#define CBC_TH_SHM_COOLING	0x2
+
+struct cbc_th_shm_entry {
+	char name[CBC_TH_SHM_NAME_MAX];	/* same as /run/cbc_thermal/<name> */
+	int32_t value;
+	uint32_t flags;
+	uint64_t ts_ns;			/* CLOCK_MONOTONIC of the last update */
+};
+
+struct cbc_th_shm {
+	uint32_t magic;			/* CBC_TH_SHM_MAGIC */
+	uint16_t version;		/* CBC_TH_SHM_VERSION */
+	uint16_t entry_size;		/* sizeof(struct cbc_th_shm_entry) */
+	uint32_t seq;			/* sequence lock, odd during updates */
+	uint32_t generation;		/* bumped when the table is rebuilt */
+	uint32_t count;			/* number of entries */
+	uint32_t reserved;
+	struct cbc_th_shm_entry entries[];
+};
+
+static inline struct cbc_th_shm *cbc_th_shm_map(void)
+{
+	struct cbc_th_shm *shm;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(CBC_TH_SHM_NAME, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size != CBC_TH_SHM_SIZE) {
+		close(fd);
+		return NULL;
+	}
+	shm = mmap(NULL, CBC_TH_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+	if (shm->magic != CBC_TH_SHM_MAGIC || shm->version != CBC_TH_SHM_VERSION ||
+	    shm->entry_size != sizeof(struct cbc_th_shm_entry)) {
+		munmap(shm, CBC_TH_SHM_SIZE);
+		return NULL;
+	}
+	return shm;
+}
+
+static inline void cbc_th_shm_unmap(struct cbc_th_shm *shm)
+{
+	munmap(shm, CBC_TH_SHM_SIZE);
+}
+
+static inline uint32_t cbc_th_shm_read_begin(const struct cbc_th_shm *shm)
+{
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+static inline int cbc_th_shm_read_retry(const struct cbc_th_shm *shm, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* index of the entry called name, -1 if not found */
+static inline int cbc_th_shm_find(const struct cbc_th_shm *shm, const char *name)
+{
+	uint32_t i, count = __atomic_load_n(&shm->count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count && i < CBC_TH_SHM_ENTRY_MAX; i++) {
+		if (strncmp(shm->entries[i].name, name, CBC_TH_SHM_NAME_MAX) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* consistent copy of one entry, ts_ns may be NULL */
+static inline int cbc_th_shm_read(const struct cbc_th_shm *shm, int idx,
+				int32_t *value, uint64_t *ts_ns)
+{
+	const struct cbc_th_shm_entry *e;
+	uint64_t ts;
+	int32_t val;
+	uint32_t seq;
+
+	if (idx < 0 || (size_t)idx >= CBC_TH_SHM_ENTRY_MAX)
+		return -1;
+	e = &shm->entries[idx];
+	do {
+		seq = cbc_th_shm_read_begin(shm);
+		val = __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+		ts = __atomic_load_n(&e->ts_ns, __ATOMIC_RELAXED);
+	} while (cbc_th_shm_read_retry(shm, seq));
+	*value = val;
+	if (ts_ns)
+		*ts_ns = ts;
+	return 0;
+}
+
+/* consistent copy of up to max entries, returns the number copied */
+static inline int cbc_th_shm_snapshot(const struct cbc_th_shm *shm,
+				struct cbc_th_shm_entry *entries, int max)
+{
+	uint32_t seq;
+	int n;
+
+	do {
+		seq = cbc_th_shm_read_begin(shm);
+		n = shm->count < (uint32_t)max ? (int)shm->count : max;
+		if ((size_t)n > CBC_TH_SHM_ENTRY_MAX)
+			n = CBC_TH_SHM_ENTRY_MAX;
+		memcpy(entries, shm->entries, n * sizeof(*entries));
+	} while (cbc_th_shm_read_retry(shm, seq));
+	return n;
+}
+
+#endif /* CBC_THERMAL_SHM_H */
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * SPDX-License-identifier: BSD-3-Clause
+ */
+
+/*
+ * Decoder of the cbc_thermal trace files (format in cbc_thermal.h).
+ * Prints "boot_id,time,name,value" CSV lines, time in seconds since
+ * the epoch. Arguments are trace files or directories of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cbc_thermal.h"
+
+#define TRACE_DIR "/var/log/cbc_thermal"
+#define TRACE_PATH_MAX 512
+
+struct trace_file {
+	char path[TRACE_PATH_MAX];
+	uint64_t realtime_ns;
+};
+
+/* -1 at the end of the file, a cut varint included */
+static int trace_uvarint(FILE *file, uint64_t *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	while ((c = fgetc(file)) != EOF) {
+		if (shift < 64)
+			*v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static int trace_header(const char *path, struct cbc_th_trace_header *header)
+{
+	FILE *file = fopen(path, "r");
+	int ret = -1;
+
+	if (!file)
+		return -1;
+	if (fread(header, sizeof(*header), 1, file) == 1 &&
+	    header->magic == CBC_TH_TRACE_MAGIC && header->version == CBC_TH_TRACE_VERSION)
+		ret = 0;
+	fclose(file);
+	return ret;
+}
+
+static int trace_decode(const char *path)
+{
+	struct cbc_th_trace_header header;
+	struct cbc_th_trace_signal *sigs;
+	uint64_t tag, ts = 0, v, ns;
+	int64_t *vals;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file || fread(&header, sizeof(header), 1, file) != 1 ||
+	    header.magic != CBC_TH_TRACE_MAGIC || header.version != CBC_TH_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a cbc_thermal trace\n", path);
+		if (file)
+			fclose(file);
+		return -1;
+	}
+	header.boot_id[sizeof(header.boot_id) - 1] = 0;
+	sigs = calloc(header.count, sizeof(*sigs));
+	vals = calloc(header.count, sizeof(*vals));
+	if (!sigs || !vals || fread(sigs, sizeof(*sigs), header.count, file) != header.count) {
+		fprintf(stderr, "%s: truncated header\n", path);
+		goto out;
+	}
+
+	while (trace_uvarint(file, &tag) == 0) {
+		if (tag == 0) {
+			if (trace_uvarint(file, &ts) < 0)
+				break;
+			memset(vals, 0, sizeof(*vals) * header.count);
+			continue;
+		}
+		if (trace_uvarint(file, &v) < 0)
+			break;
+		ts += v;
+		if (trace_uvarint(file, &v) < 0)
+			break;
+		if (tag > header.count) {
+			fprintf(stderr, "%s: invalid signal %llu\n", path, (unsigned long long)tag);
+			break;
+		}
+		vals[tag - 1] += (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+		ns = header.realtime_ns + ts * 1000 - header.monotonic_ns;
+		printf("%s,%llu.%06llu,%.*s,%lld\n", header.boot_id,
+			(unsigned long long)(ns / 1000000000ull),
+			(unsigned long long)(ns % 1000000000ull / 1000),
+			CBC_TH_TRACE_NAME_MAX, sigs[tag - 1].name, (long long)vals[tag - 1]);
+	}
+out:
+	fclose(file);
+	free(sigs);
+	free(vals);
+	return 0;
+}
+
+static int trace_file_cmp(const void *a, const void *b)
+{
+	const struct trace_file *fa = a, *fb = b;
+
+	if (fa->realtime_ns != fb->realtime_ns)
+		return fa->realtime_ns < fb->realtime_ns ? -1 : 1;
+	return strcmp(fa->path, fb->path);
+}
+
+/* all parts of a directory, oldest first */
+static int trace_decode_dir(const char *dir)
+{
+	struct cbc_th_trace_header header;
+	struct trace_file *files = NULL, *tmp;
+	struct dirent *d;
+	DIR *dp;
+	int i, n = 0;
+
+	dp = opendir(dir);
+	if (!dp) {
+		fprintf(stderr, "open %s error\n", dir);
+		return -1;
+	}
+	while ((d = readdir(dp))) {
+		size_t len = strlen(d->d_name);
+
+		if (len <= 4 || strcmp(d->d_name + len - 4, ".ctt"))
+			continue;
+		tmp = realloc(files, (n + 1) * sizeof(*files));
+		if (!tmp)
+			break;
+		files = tmp;
+		snprintf(files[n].path, sizeof(files[n].path), "%s/%.255s", dir, d->d_name);
+		if (trace_header(files[n].path, &header) == 0) {
+			files[n].realtime_ns = header.realtime_ns;
+			n++;
+		}
+	}
+	closedir(dp);
+	qsort(files, n, sizeof(*files), trace_file_cmp);
+	for (i = 0; i < n; i++)
+		trace_decode(files[i].path);
+	free(files);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+	int i, ret = 0;
+
+	if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+		printf("Usage: %s [<trace file or directory>...], default " TRACE_DIR "\n", argv[0]);
+		return 0;
+	}
+	printf("boot_id,time,name,value\n");
+	if (argc < 2)
+		return trace_decode_dir(TRACE_DIR) ? 1 : 0;
+	for (i = 1; i < argc; i++) {
+		if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+			ret |= trace_decode_dir(argv[i]);
+		else
+			ret |= trace_decode(argv[i]);
+	}
+	return ret ? 1 : 0;
+}